@@ -4,19 +4,23 @@
 #include "xv6.h"
 
 static int xv6_balloc_rng(struct super_block *sb, uint *block, uint start, 
-             uint end);
+             uint end, bool zero);
 
 static inline int xv6_bzero(struct super_block *sb, uint block) {
     if (sb->s_flags & SB_RDONLY) {
         return -EROFS;
     }
     
-    struct buffer_head *bh = sb_bread(sb, block);
+    /* The whole block is overwritten, so do not read it first. */
+    struct buffer_head *bh = sb_getblk(sb, block);
     if (!bh) {
-        xv6_error("unable to read block %u for zeroing", block);
+        xv6_error("unable to get block %u for zeroing", block);
         return -EIO;
     }
+    lock_buffer(bh);
     memset(bh->b_data, 0, BSIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
     mark_buffer_dirty(bh);
     int error = sync_dirty_buffer(bh);
     brelse(bh);
@@ -54,12 +58,12 @@ static int xv6_bfree_unsafe(struct super_block *sb, uint block) {
 
     bitmap[index] &= ~mask;
     mark_buffer_dirty(bh);
-    int error = sync_dirty_buffer(bh);
+    fsinfo->bmap_dirty = true;
     brelse(bh);
-    return error;
+    return 0;
 }
 
-static int xv6_balloc_unsafe(struct super_block *sb, uint *block) {
+static int xv6_balloc_unsafe(struct super_block *sb, uint *block, bool zero) {
     if (sb->s_flags & SB_RDONLY) {
         return -EROFS;
     }
@@ -72,7 +76,7 @@ static int xv6_balloc_unsafe(struct super_block *sb, uint *block) {
     int error = 0;
     /* Try alloc in range [hint, data_end) */
     if (hint < data_end) {
-        error = xv6_balloc_rng(sb, block, hint, data_end);
+        error = xv6_balloc_rng(sb, block, hint, data_end, zero);
         if (*block || error) {
             hint = fsinfo->balloc_hint;
             fsinfo->balloc_hint = (hint >= data_end) ? (data_start) : hint;
@@ -81,7 +85,7 @@ static int xv6_balloc_unsafe(struct super_block *sb, uint *block) {
     }
     /* Try alloc in range [data_start, hint) */
     if (data_start < hint) {
-        error = xv6_balloc_rng(sb, block, data_start, hint);
+        error = xv6_balloc_rng(sb, block, data_start, hint, zero);
         if (*block || error) {
             hint = fsinfo->balloc_hint;
             fsinfo->balloc_hint = (hint >= data_end) ? (data_start) : hint;
@@ -94,7 +98,7 @@ static int xv6_balloc_unsafe(struct super_block *sb, uint *block) {
 }
 
 static int xv6_balloc_rng(struct super_block *sb, uint *block, uint start, 
-              uint end) {
+              uint end, bool zero) {
     struct xv6_fs_info *fsinfo = sb->s_fs_info;
     const uint bits_per_elem = sizeof(unsigned int) * 8;
     uint alloc = start;
@@ -113,7 +117,7 @@ try_balloc:
         goto end_balloc;
     }
     unsigned int *bitarray = (unsigned int *) bh->b_data;
-    uint iter_end = (alloc + BPB - 1) / BPB * BPB;
+    uint iter_end = (alloc / BPB + 1) * BPB;
     iter_end = xv6_min(iter_end, end);
     bool succ = false;
 
@@ -123,13 +127,14 @@ try_balloc:
         mask = (1u << mask);
     
         if ((mask & bitarray[index]) == 0) {
-            if ((error = xv6_bzero(sb, alloc)) != 0) {
+            if (zero && (error = xv6_bzero(sb, alloc)) != 0) {
                 /* Do not try to allocate. */
                 fsinfo->balloc_hint = alloc;
             } else {
+                /* Written back lazily, see xv6_bmap_sync. */
                 bitarray[index] |= mask;
                 mark_buffer_dirty(bh);
-                error = sync_dirty_buffer(bh);
+                fsinfo->bmap_dirty = true;
                 *block = alloc;
                 fsinfo->balloc_hint = alloc + 1;
             }
@@ -153,7 +158,34 @@ end_balloc:
 static int xv6_balloc(void *privat, uint *block) {
     struct super_block *sb = privat;
     mutex_lock(xv6_balloc_lock(sb));
-    int error = xv6_balloc_unsafe(sb, block);
+    int error = xv6_balloc_unsafe(sb, block, true);
+    mutex_unlock(xv6_balloc_lock(sb));
+    return error;
+}
+static int xv6_balloc_data(void *privat, uint *block) {
+    struct super_block *sb = privat;
+    mutex_lock(xv6_balloc_lock(sb));
+    int error = xv6_balloc_unsafe(sb, block, false);
+    mutex_unlock(xv6_balloc_lock(sb));
+    return error;
+}
+static int xv6_bmap_sync(struct super_block *sb) {
+    struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    if (!READ_ONCE(fsinfo->bmap_dirty)) {
+        return 0;
+    }
+    int error = 0;
+    mutex_lock(xv6_balloc_lock(sb));
+    for (uint i = 0; i < fsinfo->nbmap_blocks; i++) {
+        /* A dirty buffer cannot have left the cache. */
+        struct buffer_head *bh = sb_find_get_block(sb, fsinfo->bmapstart + i);
+        if (bh) {
+            int err = sync_dirty_buffer(bh);
+            error = error ? error : err;
+            brelse(bh);
+        }
+    }
+    fsinfo->bmap_dirty = error != 0;
     mutex_unlock(xv6_balloc_lock(sb));
     return error;
 }
@@ -163,3 +195,61 @@ static int xv6_bfree(struct super_block *sb, uint block) {
     mutex_unlock(xv6_balloc_lock(sb));
     return error;
 }
+static int xv6_bfree_reserve(struct inode *inode, uint n) {
+    struct xv6_bpend *bp = &((struct xv6_inode_info *) inode->i_private)->bpend;
+    int error = 0;
+    mutex_lock(xv6_balloc_lock(inode->i_sb));
+    if (bp->count + n > bp->cap) {
+        uint cap = max(bp->count + n, bp->cap ? bp->cap * 2 : 16);
+        uint *blocks = krealloc_array(bp->blocks, cap, sizeof(uint), GFP_NOFS);
+        if (blocks) {
+            bp->blocks = blocks;
+            bp->cap = cap;
+        } else {
+            error = -ENOMEM;
+        }
+    }
+    mutex_unlock(xv6_balloc_lock(inode->i_sb));
+    return error;
+}
+static void xv6_bfree_later(struct inode *inode, uint block) {
+    struct xv6_bpend *bp = &((struct xv6_inode_info *) inode->i_private)->bpend;
+    mutex_lock(xv6_balloc_lock(inode->i_sb));
+    xv6_assert(bp->count < bp->cap && "xv6_bfree_reserve was not called");
+    bp->blocks[bp->count++] = block;
+    mutex_unlock(xv6_balloc_lock(inode->i_sb));
+}
+static uint xv6_bfree_waiting(struct inode *inode) {
+    struct xv6_inode_info *ii = inode->i_private;
+    if (!ii) {
+        return 0;
+    }
+    mutex_lock(xv6_balloc_lock(inode->i_sb));
+    uint n = ii->bpend.count;
+    mutex_unlock(xv6_balloc_lock(inode->i_sb));
+    return n;
+}
+static void xv6_bfree_release(struct inode *inode, uint n) {
+    struct xv6_inode_info *ii = inode->i_private;
+    if (!ii || n == 0) {
+        return;
+    }
+    struct xv6_bpend *bp = &ii->bpend;
+    mutex_lock(xv6_balloc_lock(inode->i_sb));
+    for (uint i = 0; i < n; i++) {
+        (void) xv6_bfree_unsafe(inode->i_sb, bp->blocks[i]);
+    }
+    /* Frees queued after the inode was copied out wait for the next. */
+    memmove(bp->blocks, bp->blocks + n, (bp->count - n) * sizeof(uint));
+    bp->count -= n;
+    mutex_unlock(xv6_balloc_lock(inode->i_sb));
+}
+static void xv6_bfree_forget(struct inode *inode) {
+    struct xv6_inode_info *ii = inode->i_private;
+    if (ii->bpend.count) {
+        xv6_warn("inode %lu: %u freed blocks leaked, inode never written",
+                    inode->i_ino, ii->bpend.count);
+    }
+    kfree(ii->bpend.blocks);
+    memset(&ii->bpend, 0, sizeof(ii->bpend));
+}
@@ -91,6 +91,117 @@ xv6_check_sb(const struct superblock *sb, struct checker *check,
     return check_size;
 }
 
+/*
+ * Every entry of a hashed directory must sit in the bucket of its hash,
+ * unless the header says that entries have spilled.
+ */
+static bool 
+xv6_check_hdir(struct checker *check, struct xv6_inode_ctx *dir,
+                const struct xv6_hdir *head) noexcept {
+    const uint split = __le16_to_cpu(head->split);
+    if (head->level >= 16 || split >= (1u << head->level) ||
+        dir->size != (1 + (1u << head->level) + split) * BSIZE) {
+        check->error("%s hashed directory has bad header "
+                    "(level %u, split %u, size %u)\n", check->err, 
+                    head->level, split, dir->size);
+        return false;
+    }
+
+    if (head->flags & ~XV6_HDIR_SPILL) {
+        check->error("%s hashed directory has unknown flags 0x%x\n",
+                    check->err, head->flags);
+        return false;
+    }
+    if (head->flags & XV6_HDIR_SPILL) {
+        /* Lookups scan on a miss, so any slot will do. */
+        return true;
+    }
+
+    uint nbad = 0;
+    auto hdir_check = [check, head, &nbad](uint dnum, 
+            struct dirent *de) -> struct xv6_diter_action {
+        const uint nents = BSIZE / sizeof(struct dirent);
+        xv6_diter_action ret = xv6_diter_action_init;
+        ret.cont = 1;
+        if (de->inum == 0 || dnum < XV6_HDIR_SLOT) {
+            return ret;
+        }
+
+        struct xv6_dname dn;
+        xv6_dname_from_dirent(&dn, de);
+        uint h = xv6_hdir_hash((const char *) &dn, __le32_to_cpu(head->seed));
+        uint want = xv6_hdir_bucket(head->level, 
+                    __le16_to_cpu(head->split), h);
+        if (dnum < nents) {
+            check->error("%s entry %u is in the header block "
+                        "of a hashed directory\n", check->err, dnum);
+            nbad++;
+        } else if (dnum / nents - 1 != want) {
+            check->error("%s entry %u belongs to bucket %u, "
+                        "found in bucket %u\n", check->err, dnum,
+                        want, dnum / nents - 1);
+            nbad++;
+        }
+        return ret;
+    };
+    if (xv6_dir_iterate_t(check, dir, hdir_check, 0, false) != 0) {
+        check->error("%s iterating hashed directory failed.\n", check->err);
+        return false;
+    }
+    return nbad == 0;
+}
+
+/* Runs xv6_check_hdir on each directory whose block 0 has the magic. */
+static bool 
+xv6_check_hdirs(struct checker *check, uint ninodes,
+                const xv6_checker_info *info, uint features) noexcept {
+    bool ok = true;
+    for (uint inum = ROOTINO; inum < ninodes; inum++) {
+        struct dinode dino;
+        do {
+            struct bufptr bp(check->bread(check->privat,
+                        info->inodestart + inum / IPB), check);
+            if (bp.buf_ == nullptr) {
+                check->error("%s reading inode %u failed.\n", check->err, inum);
+                return false;
+            }
+            dino = reinterpret_cast<struct dinode *>(bp.data())[inum % IPB];
+        } while (0);
+        if (__le16_to_cpu(dino.type) != T_DIR) {
+            continue;
+        }
+
+        uint addrs[NDIRECT + 1];
+        for (int i = 0; i <= NDIRECT; i++) {
+            addrs[i] = __le32_to_cpu(dino.addrs[i]);
+        }
+        struct xv6_inode_ctx dc = {
+            .addrs = addrs,
+            .size = __le32_to_cpu(dino.size),
+            .dirty = false,
+        };
+        struct xv6_hdir head;
+        int hashed = xv6_hdir_head(check, &dc, &head);
+        if (hashed < 0) {
+            check->error("%s reading directory %u failed.\n", check->err, inum);
+            return false;
+        }
+        if (!hashed) {
+            continue;
+        }
+        if (!(features & XV6_FEATURE_HDIR)) {
+            check->error("%s directory %u is hashed, but the hashed "
+                        "directory feature is off\n", check->err, inum);
+            return false;
+        }
+        if (!xv6_check_hdir(check, &dc, &head)) {
+            check->error("%s in hashed directory %u\n", check->err, inum);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
 int xv6_docheck(struct checker *check) noexcept {
     if (!check->bread || !check->bdata) {
         return 1;
@@ -123,6 +234,12 @@ int xv6_docheck(struct checker *check) noexcept {
         return 1;
     }
 
+    const uint features = xuint(sb.features);
+    if (features & ~(XV6_FEATURE_HDIR | XV6_FEATURE_ZFILE)) {
+        check->error("%s unknown features 0x%x\n", check->err, features);
+        return 1;
+    }
+
     /* Check size and start of each layer. */
     struct xv6_checker_info info;
     if (! xv6_check_sb(&sb, check, &info)) {
@@ -149,9 +266,8 @@ int xv6_docheck(struct checker *check) noexcept {
         }
     } while (0);
     /* Directory entry checker. */
-    auto dir_check = [](uint dnum, struct dirent *de, 
-            void *ctx) -> struct xv6_diter_action {
-        auto *check = (checker *) ctx;
+    auto dir_check = [check](uint dnum, 
+            struct dirent *de) -> struct xv6_diter_action {
         xv6_diter_action ret = xv6_diter_action_init;
         ret.cont = 1;
         
@@ -171,12 +287,18 @@ int xv6_docheck(struct checker *check) noexcept {
             .dirty = false,
         };
 
-        if (xv6_dir_iterate(check, &rc, dir_check, check, 2, false) != 0) {
+        if (xv6_dir_iterate_t(check, &rc, dir_check, 2, false) != 0) {
             check->error("%s iterating root directory failed.\n", check->err);
             return 1;
         }
+
     } while (0);
 
+    /* Every hashed directory, the root or made later by the kernel. */
+    if (!xv6_check_hdirs(check, xuint(sb.ninodes), &info, features)) {
+        return 1;
+    }
+
     /* All check passed. */
     return 0;
 }
@@ -14,6 +14,8 @@ struct checker {
     void *(* bdata)(void *); /**< Given the buffer, get its internal data. */
     void (*brelse)(void *); /**< Release an buffer. */
     int (* balloc)(void *, uint *); /**< same as xv6_balloc(). */ 
+    int (* balloc_data)(void *, uint *); /**< balloc, but not zeroed. */
+    int (* bfree)(void *, uint); /**< same as xv6_bfree(). */
     int (* bflush)(void *sb, void *buf); /**< Sync dirty buffer. */
 
     const char *warn; /**< Prefix of warning message. */
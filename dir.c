@@ -1,6 +1,8 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/mount.h>
+#include <linux/slab.h>
 
 #include "fs.h"
 #include "fsinfo.h"
@@ -27,38 +29,371 @@ static inline int xv6_dget(struct inode *dir, struct dinode *dino) {
     return 0;
 }
 
-static struct xv6_diter_action de_find_callback(uint dnum, 
+/* +-+ Free dirent slots +-+ */
+
+/* Record a free slot. Must hold ii->dir_lock. */
+static void xv6_dfree_push(struct xv6_inode_info *ii, uint dnum) {
+    struct xv6_dfree *df = &ii->dfree;
+    if (df->count == df->cap) {
+        uint cap = df->cap ? df->cap * 2 : 16;
+        uint *slots = krealloc_array(df->slots, cap, sizeof(uint), GFP_NOFS);
+        if (unlikely(!slots)) {
+            /* This hole is lost until the next full scan. */
+            df->complete = false;
+            return;
+        }
+        df->slots = slots;
+        df->cap = cap;
+    }
+    df->slots[df->count++] = dnum;
+}
+
+static void xv6_dfree_reset(struct xv6_inode_info *ii) {
+    kfree(ii->dfree.slots);
+    memset(&ii->dfree, 0, sizeof(ii->dfree));
+}
+
+/*
+ * Choose where xv6_dentry_insert should start scanning: a known free
+ * slot, the last entry if the directory has no free slot at all (the
+ * iterator then extends it), or 0 if nothing is known.
+ */
+static uint xv6_dfree_pick(struct inode *dir) {
+    struct xv6_inode_info *ii = dir->i_private;
+    uint start = 0;
+    if (!ii) {
+        return 0;
+    }
+    mutex_lock(&ii->dir_lock);
+    if (ii->dfree.count) {
+        start = ii->dfree.slots[--ii->dfree.count];
+    } else if (ii->dfree.complete) {
+        start = dir->i_size / sizeof(struct dirent) - 1;
+    }
+    mutex_unlock(&ii->dir_lock);
+    return start;
+}
+
+/* Note that dnum is now free, e.g. after erasing it. */
+static void xv6_dfree_add(struct inode *dir, uint dnum) {
+    struct xv6_inode_info *ii = dir->i_private;
+    if (ii) {
+        mutex_lock(&ii->dir_lock);
+        xv6_dfree_push(ii, dnum);
+        mutex_unlock(&ii->dir_lock);
+    }
+}
+
+/* A full scan found no free slot before the end. */
+static void xv6_dfree_set_complete(struct inode *dir) {
+    struct xv6_inode_info *ii = dir->i_private;
+    if (ii) {
+        mutex_lock(&ii->dir_lock);
+        ii->dfree.count = 0;
+        ii->dfree.complete = true;
+        mutex_unlock(&ii->dir_lock);
+    }
+}
+
+/*
+ * An insert failed after xv6_dfree_pick took its slot, which may or may
+ * not have been used. Forget that the list is complete, so the next
+ * insert scans from the start and xv6_dir_sparse does not count on it.
+ */
+static void xv6_dfree_set_incomplete(struct inode *dir) {
+    struct xv6_inode_info *ii = dir->i_private;
+    if (ii) {
+        mutex_lock(&ii->dir_lock);
+        ii->dfree.complete = false;
+        mutex_unlock(&ii->dir_lock);
+    }
+}
+
+/* +-+ In-memory directory name index +-+ */
+
+/* Every directory holding an index, in rough LRU order. */
+static LIST_HEAD(xv6_dindex_lru);
+static DEFINE_SPINLOCK(xv6_dindex_lru_lock);
+/* Total number of index entries, reported to the shrinker. */
+static atomic_long_t xv6_dindex_nr = ATOMIC_LONG_INIT(0);
+
+static inline struct hlist_head *xv6_dindex_bucket(struct xv6_dindex *idx,
+            uint hash) {
+    return &idx->buckets[hash & (idx->nbuckets - 1)];
+}
+
+static struct xv6_dindex_ent *xv6_dindex_find(struct xv6_dindex *idx,
+            const struct xv6_dname *name) {
+    const uint hash = xv6_dname_hash(name, 0);
+    struct xv6_dindex_ent *ent;
+    hlist_for_each_entry(ent, xv6_dindex_bucket(idx, hash), node) {
+        if (ent->hash == hash && xv6_dname_eq(&ent->name, name)) {
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+/* Double the bucket array. On -ENOMEM, simply keep longer chains. */
+static void xv6_dindex_grow(struct xv6_dindex *idx) {
+    const uint n = idx->nbuckets * 2;
+    struct hlist_head *old = idx->buckets;
+    struct hlist_head *nb = kvmalloc_array(n, sizeof(*nb), GFP_NOFS);
+    if (!nb) {
+        return;
+    }
+    for (uint i = 0; i < n; i++) {
+        INIT_HLIST_HEAD(&nb[i]);
+    }
+    for (uint i = 0; i < idx->nbuckets; i++) {
+        struct xv6_dindex_ent *ent;
+        struct hlist_node *tmp;
+        hlist_for_each_entry_safe(ent, tmp, &old[i], node) {
+            hlist_del(&ent->node);
+            hlist_add_head(&ent->node, &nb[ent->hash & (n - 1)]);
+        }
+    }
+    idx->buckets = nb;
+    idx->nbuckets = n;
+    kvfree(old);
+}
+
+static int xv6_dindex_add(struct xv6_dindex *idx,
+            const struct xv6_dname *name, uint dnum, uint inum) {
+    struct xv6_dindex_ent *ent = kmem_cache_alloc(xv6_dindex_cachep, GFP_NOFS);
+    if (unlikely(!ent)) {
+        return -ENOMEM;
+    }
+    ent->name = *name;
+    ent->hash = xv6_dname_hash(name, 0);
+    ent->dnum = dnum;
+    ent->inum = inum;
+    hlist_add_head(&ent->node, xv6_dindex_bucket(idx, ent->hash));
+    idx->count++;
+    atomic_long_inc(&xv6_dindex_nr);
+    if (idx->count > idx->nbuckets) {
+        xv6_dindex_grow(idx);
+    }
+    return 0;
+}
+
+static void xv6_dindex_del(struct xv6_dindex *idx, struct xv6_dindex_ent *ent) {
+    hlist_del(&ent->node);
+    kmem_cache_free(xv6_dindex_cachep, ent);
+    idx->count--;
+    atomic_long_dec(&xv6_dindex_nr);
+}
+
+/* Free an index that is no longer reachable. */
+static void xv6_dindex_free(struct xv6_dindex *idx) {
+    for (uint i = 0; i < idx->nbuckets; i++) {
+        struct xv6_dindex_ent *ent;
+        struct hlist_node *tmp;
+        hlist_for_each_entry_safe(ent, tmp, &idx->buckets[i], node) {
+            xv6_dindex_del(idx, ent);
+        }
+    }
+    kvfree(idx->buckets);
+    kfree(idx);
+}
+
+static struct xv6_diter_action dindex_build_callback(uint dnum,
             struct dirent *de, void *ctx) {
     void **arr = ctx;
-    const char *target = (const void *) arr[0];
-    uint *dnumout = arr[1];
-    struct dirent *deout = arr[2];
+    struct xv6_dindex *idx = arr[0];
+    int *error = arr[1];
 
     struct xv6_diter_action next = xv6_diter_action_init;
     next.cont = 1;
-    if (strncmp(target, de->name, DIRSIZ) == 0) {
-        next.cont = 0;
-        /* Copy out the results. */
-        *deout = *de;
-        *dnumout = dnum;
+    if (de->inum != 0) {
+        struct xv6_dname name;
+        xv6_dname_from_dirent(&name, de);
+        *error = xv6_dindex_add(idx, &name, dnum, __le16_to_cpu(de->inum));
+        next.cont = (*error == 0);
+    } else {
+        /* The same scan tells us every free slot. */
+        xv6_dfree_push(idx->owner, dnum);
     }
-
     return next;
 }
 
+/*
+ * Return the index of dir, building it with one scan on first use.
+ * Must hold ii->dir_lock. Returns NULL if it cannot be built, in
+ * which case the caller should fall back to a linear scan.
+ */
+static struct xv6_dindex *xv6_dindex_get(struct inode *dir,
+            struct xv6_inode_info *ii) {
+    struct xv6_dindex *idx = ii->dindex;
+    if (idx) {
+        idx->referenced = true;
+        return idx;
+    }
+
+    idx = kzalloc(sizeof(*idx), GFP_NOFS);
+    if (!idx) {
+        return NULL;
+    }
+    idx->nbuckets = XV6_DINDEX_MIN_BUCKETS;
+    idx->buckets = kvmalloc_array(idx->nbuckets, sizeof(*idx->buckets), 
+                GFP_NOFS);
+    if (!idx->buckets) {
+        kfree(idx);
+        return NULL;
+    }
+    for (uint i = 0; i < idx->nbuckets; i++) {
+        INIT_HLIST_HEAD(&idx->buckets[i]);
+    }
+    idx->owner = ii;
+
+    struct xv6_fs_info *fsinfo = dir->i_sb->s_fs_info;
+    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(dir);
+    ictx.addrs = ii->addrs;
+    int cberr = 0;
+    void *ctx[2] = { idx, &cberr };
+    ii->dfree.count = 0;
+    ii->dfree.complete = true;
+    int error = xv6_dir_iterate(&fsinfo->check, &ictx, dindex_build_callback,
+                (void **) ctx, 2 /* skip . and .. */, false);
+    if (error || cberr) {
+        ii->dfree.complete = false;
+        xv6_dindex_free(idx);
+        return NULL;
+    }
+
+    spin_lock(&xv6_dindex_lru_lock);
+    list_add_tail(&idx->lru, &xv6_dindex_lru);
+    spin_unlock(&xv6_dindex_lru_lock);
+    ii->dindex = idx;
+    return idx;
+}
+
+/* Detach and free the index of a directory, e.g. on eviction. */
+static void xv6_dindex_drop(struct xv6_inode_info *ii) {
+    mutex_lock(&ii->dir_lock);
+    struct xv6_dindex *idx = ii->dindex;
+    if (idx) {
+        spin_lock(&xv6_dindex_lru_lock);
+        list_del(&idx->lru);
+        spin_unlock(&xv6_dindex_lru_lock);
+        ii->dindex = NULL;
+    }
+    mutex_unlock(&ii->dir_lock);
+    if (idx) {
+        xv6_dindex_free(idx);
+    }
+}
+
+/* Record a new dirent in the index, if the directory has one. */
+static void xv6_dindex_insert(struct inode *dir, const struct xv6_dname *name,
+            uint dnum, uint inum) {
+    struct xv6_inode_info *ii = dir->i_private;
+    if (!ii || !READ_ONCE(ii->dindex)) {
+        return;
+    }
+    mutex_lock(&ii->dir_lock);
+    bool stale = ii->dindex && xv6_dindex_add(ii->dindex, name, dnum, inum);
+    mutex_unlock(&ii->dir_lock);
+    if (stale) {
+        /* Cannot keep it current; rebuild on next lookup. */
+        xv6_dindex_drop(ii);
+    }
+}
+
+/* Forget an erased dirent, if the directory has an index. */
+static void xv6_dindex_erase(struct inode *dir, const struct xv6_dname *name) {
+    struct xv6_inode_info *ii = dir->i_private;
+    if (!ii || !READ_ONCE(ii->dindex)) {
+        return;
+    }
+    mutex_lock(&ii->dir_lock);
+    if (ii->dindex) {
+        struct xv6_dindex_ent *ent = xv6_dindex_find(ii->dindex, name);
+        if (ent) {
+            xv6_dindex_del(ii->dindex, ent);
+        }
+    }
+    mutex_unlock(&ii->dir_lock);
+}
+
+/*
+ * Look up a name in the index. Returns true if the index answered,
+ * in which case *dnum is 0 if the name is absent.
+ */
+static bool xv6_dindex_lookup(struct inode *dir, const struct xv6_dname *name,
+            uint *dnum, struct dirent *dout) {
+    struct xv6_inode_info *ii = dir->i_private;
+    if (!ii || dir->i_size < XV6_DINDEX_MIN_SIZE) {
+        return false;
+    }
+
+    mutex_lock(&ii->dir_lock);
+    struct xv6_dindex *idx = xv6_dindex_get(dir, ii);
+    if (idx) {
+        struct xv6_dindex_ent *ent = xv6_dindex_find(idx, name);
+        if (ent) {
+            *dnum = ent->dnum;
+            dout->inum = __cpu_to_le16(ent->inum);
+            memcpy(dout->name, &ent->name, DIRSIZ);
+        }
+    }
+    mutex_unlock(&ii->dir_lock);
+    return idx != NULL;
+}
+
+static unsigned long xv6_dindex_count(struct shrinker *shrink,
+            struct shrink_control *sc) {
+    return atomic_long_read(&xv6_dindex_nr);
+}
+
+static unsigned long xv6_dindex_scan(struct shrinker *shrink,
+            struct shrink_control *sc) {
+    unsigned long freed = 0;
+    unsigned long visit = sc->nr_to_scan;
+    LIST_HEAD(dispose);
+
+    spin_lock(&xv6_dindex_lru_lock);
+    while (freed < sc->nr_to_scan && visit-- && !list_empty(&xv6_dindex_lru)) {
+        struct xv6_dindex *idx = list_first_entry(&xv6_dindex_lru, 
+                    struct xv6_dindex, lru);
+        struct xv6_inode_info *ii = idx->owner;
+        if (idx->referenced || !mutex_trylock(&ii->dir_lock)) {
+            /* Give recently used (or busy) indexes a second chance. */
+            idx->referenced = false;
+            list_move_tail(&idx->lru, &xv6_dindex_lru);
+            continue;
+        }
+        list_move(&idx->lru, &dispose);
+        ii->dindex = NULL;
+        mutex_unlock(&ii->dir_lock);
+        freed += idx->count;
+    }
+    spin_unlock(&xv6_dindex_lru_lock);
+
+    struct xv6_dindex *idx, *tmp;
+    list_for_each_entry_safe(idx, tmp, &dispose, lru) {
+        xv6_dindex_free(idx);
+    }
+    return freed ? freed : SHRINK_STOP;
+}
+
 static struct xv6_diter_action de_erase_callback(uint dnum, 
             struct dirent *de, void *ctx) {
     void **arr = ctx;
-    const char *target = (const void *) arr[0];
+    const struct xv6_dname *target = arr[0];
     bool *success = arr[1];
+    uint *dnumout = arr[2];
 
     struct xv6_diter_action next = xv6_diter_action_init;
     next.cont = 1;
-    if (strncmp(target, de->name, DIRSIZ) == 0) {
+    struct xv6_dname name;
+    xv6_dname_from_dirent(&name, de);
+    if (xv6_dname_eq(target, &name)) {
         next.cont = 0;
         next.de_dirty = 1;
         /* Copy out the results. */
         *success = true;
+        *dnumout = dnum;
         memset(de, 0xfd, sizeof(*de));
         de->inum = 0;
         de->name[0] = 0;
@@ -67,6 +402,31 @@ static struct xv6_diter_action de_erase_callback(uint dnum,
     return next;
 }
 
+/*
+ * Is dir in the hashed format (struct xv6_hdir)? Only when the file
+ * system has XV6_FEATURE_HDIR. The answer is cached in the inode info.
+ */
+static bool xv6_dir_hashed(struct inode *dir, struct xv6_inode_ctx *ictx) {
+    struct xv6_fs_info *fsinfo = dir->i_sb->s_fs_info;
+    struct xv6_inode_info *ii = dir->i_private;
+    if (!(fsinfo->features & XV6_FEATURE_HDIR)) {
+        return false;
+    }
+    if (ii && ii->dirfmt != XV6_DIRFMT_UNKNOWN) {
+        return ii->dirfmt == XV6_DIRFMT_HASHED;
+    }
+
+    struct xv6_hdir head;
+    int ret = xv6_hdir_head(&fsinfo->check, ictx, &head);
+    if (ret < 0) {
+        return false;
+    }
+    if (ii) {
+        ii->dirfmt = ret ? XV6_DIRFMT_HASHED : XV6_DIRFMT_LINEAR;
+    }
+    return ret;
+}
+
 static int xv6_find_inum(struct inode *dir, const char *name, uint *dnum,
             struct dirent *dout) {
     if ((dir->i_mode & S_IFMT) != S_IFDIR) {
@@ -74,10 +434,9 @@ static int xv6_find_inum(struct inode *dir, const char *name, uint *dnum,
         return -ENOTDIR;
     }
 
-    void *ctx[3];
-    ctx[0] = (void *) (uintptr_t) name;
-    ctx[1] = dnum; *dnum = 0;
-    ctx[2] = dout;
+    struct xv6_dname key;
+    xv6_dname_from_str(&key, name, strnlen(name, DIRSIZ));
+    *dnum = 0;
 
     struct super_block *sb = dir->i_sb;
     struct xv6_fs_info *fsinfo = sb->s_fs_info;
@@ -89,22 +448,31 @@ static int xv6_find_inum(struct inode *dir, const char *name, uint *dnum,
     if (unlikely(error)) {
         return error;
     }
+    if (xv6_dir_hashed(dir, &ictx)) {
+        /* Reads the header and a single bucket, even on a cold cache. */
+        return xv6_hdir_find(check, &ictx, name, dnum, dout);
+    }
+    if (xv6_dindex_lookup(dir, &key, dnum, dout)) {
+        return 0;
+    }
 
-    error = xv6_dir_iterate(check, &ictx, de_find_callback, 
-                (void **) ctx, 0, false);
+    error = xv6_dir_find(check, &ictx, &key, 0, dnum, dout);
     xv6_assert (!ictx.dirty && "dirfind should not mut inode");
     return error;
 }
 
 static struct xv6_diter_action de_insert_callback(uint dnum, 
             struct dirent *de, void *ctx) {
-    const struct dirent *nde = (const void *)ctx;
+    void **arr = ctx;
+    const struct dirent *nde = arr[0];
+    uint *dnumout = arr[1];
     struct xv6_diter_action next = xv6_diter_action_init;
     next.dir_dirty = next.dir_ext = 1;
     if (de->inum == 0) {
         xv6_assert (de->name[0] == 0 && "empty name found");
         next.cont = 0;
         memcpy(de, nde, sizeof(*de));
+        *dnumout = dnum;
         next.de_dirty = true;
         return next;
     }
@@ -139,21 +507,171 @@ static int xv6_dentry_insert(struct inode *dir, const char *name, uint inum) {
     if (unlikely(error)) {
         return error;
     }
+    uint dnum = 0;
+    struct xv6_inode_info *ii = dir->i_private;
+    /* Entries may only move while no open handle has a position. */
+    const bool move = !ii || atomic_read(&ii->nopen) == 0;
+    bool hashed = xv6_dir_hashed(dir, &ictx);
+    if (!hashed && move && (fsinfo->features & XV6_FEATURE_HDIR)) {
+        /* A full one-block directory, not open, becomes hashed. */
+        error = xv6_hdir_convert(check, &ictx, get_random_u32() ?: 1);
+        if (error < 0) {
+            return error;
+        }
+        hashed = error;
+        if (hashed && ii) {
+            ii->dirfmt = XV6_DIRFMT_HASHED;
+        }
+    }
+    if (hashed) {
+        error = xv6_hdir_insert(check, &ictx, &newde, &dnum, move);
+        int serr = xv6_ictx_dirty(dir, &ictx);
+        return error ? error : serr;
+    }
+
+    if (move && xv6_dir_sparse(dir)) {
+        /* An erase had to leave it while the directory was open. */
+        (void) xv6_dir_compact(dir, NULL);
+        ictx.size = dir->i_size;
+    }
+
     /* iterator will do synchronize for us. */
-    error = xv6_dir_iterate(check, &ictx, de_insert_callback, &newde,
-                0, true);
+    void *ctx[2] = { &newde, &dnum };
+    const uint start = xv6_dfree_pick(dir);
+    const uint oldsize = ictx.size;
+    error = xv6_dir_iterate(check, &ictx, de_insert_callback, (void **) ctx,
+                start, true);
     if (!error) {
         error = xv6_ictx_dirty(dir, &ictx);
     }
+    if (!error && start == 0 && ictx.size != oldsize) {
+        /* Scanned the whole directory and found no hole. */
+        xv6_dfree_set_complete(dir);
+    } else if (error) {
+        xv6_dfree_set_incomplete(dir);
+    }
+    if (!error) {
+        struct xv6_dname key;
+        xv6_dname_from_dirent(&key, &newde);
+        xv6_dindex_insert(dir, &key, dnum, inum);
+    }
     return error;
 }
 
+/* Start reading the block of inode `inum', unless it was the last one. */
+static void xv6_ira_inode(struct super_block *sb, uint inum, uint *last) {
+    const struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    if (inum == 0 || inum >= fsinfo->ninodes) {
+        return;
+    }
+    uint block = fsinfo->inodestart + inum / IPB;
+    if (block != *last) {
+        *last = block;
+        sb_breadahead(sb, block);
+    }
+}
+
+static struct xv6_diter_action ira_callback(uint dnum, struct dirent *de,
+            void *ctx) {
+    void **arr = ctx;
+    struct super_block *sb = arr[0];
+    uint *last = arr[1];
+    uint *left = arr[2];
+    struct xv6_diter_action next = xv6_diter_action_init;
+
+    xv6_ira_inode(sb, __le16_to_cpu(de->inum), last);
+    next.cont = --*left > 0;
+    return next;
+}
+
+static void xv6_dir_lookup_ra(struct inode *dir, uint dnum) {
+    struct xv6_inode_info *ii = dir->i_private;
+    if (!ii) {
+        return;
+    }
+    /* Lookups race on these; they are only hints. */
+    const uint nents = BSIZE / sizeof(struct dirent);
+    uint prev = READ_ONCE(ii->ra_prev);
+    uint end = READ_ONCE(ii->ra_end);
+    WRITE_ONCE(ii->ra_prev, dnum);
+    /* In order if in the same or the next block: deleted slots between. */
+    const bool seq = dnum > prev && dnum / nents - prev / nents <= 1;
+    if (READ_ONCE(ii->ra_seq) != seq) {
+        WRITE_ONCE(ii->ra_seq, seq);
+    }
+    if (!seq || dnum + XV6_IRA_DIRENTS / 2 < end) {
+        /* Not sequential, or well within the last window. */
+        return;
+    }
+
+    uint start = xv6_max(dnum + 1, end);
+    struct xv6_fs_info *fsinfo = dir->i_sb->s_fs_info;
+    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(dir);
+    struct dinode di;
+    if (xv6_init_ictx(&ictx, dir, &di) != 0 ||
+                start >= ictx.size / sizeof(struct dirent)) {
+        return;
+    }
+    WRITE_ONCE(ii->ra_end, start + XV6_IRA_DIRENTS);
+
+    uint last = 0, left = XV6_IRA_DIRENTS;
+    void *arr[3] = {dir->i_sb, &last, &left};
+    struct blk_plug plug;
+    blk_start_plug(&plug);
+    (void) xv6_dir_iterate(&fsinfo->check, &ictx, ira_callback, arr,
+                start, false);
+    blk_finish_plug(&plug);
+}
+
+/* d_type of inode `inum', from the table built at mount. */
+static uchar xv6_dtype(const struct xv6_fs_info *fsinfo, uint inum) {
+    if (!fsinfo->itypes || inum >= fsinfo->ninodes) {
+        return DT_UNKNOWN;
+    }
+    switch (READ_ONCE(fsinfo->itypes[inum])) {
+        case T_DIR: return DT_DIR;
+        /* Devices are presented as regular files, see xv6_init_inode. */
+        case T_FILE:
+        case T_DEVICE: return DT_REG;
+        default: return DT_UNKNOWN;
+    }
+}
+
+static void xv6_dir_ra(struct file *file, struct xv6_inode_ctx *ictx, uint i) {
+    struct super_block *sb = file_inode(file)->i_sb;
+    struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    uint blockno;
+    if (i * BSIZE >= ictx->size ||
+                xv6_inode_addr(&fsinfo->check, ictx, i, &blockno, false) ||
+                blockno == 0) {
+        return;
+    }
+    pgoff_t index = blockno >> (PAGE_SHIFT - sb->s_blocksize_bits);
+    if (!ra_has_index(&file->f_ra, index)) {
+        page_cache_sync_readahead(sb->s_bdev->bd_mapping, &file->f_ra,
+                    file, index, 1);
+    }
+}
+
 static struct xv6_diter_action readdir_callback(uint dnum, struct dirent *de,
             void *ctx) {
+    void **arr = ctx;
+    struct dir_context *dc = arr[0];
+    struct super_block *sb = arr[1];
+    uint *last = arr[2];
+    struct file *file = arr[3];
+    struct xv6_inode_ctx *ictx = arr[4];
+    const bool *ira = arr[5];
+    const struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    const uint nents = BSIZE / sizeof(struct dirent);
     struct xv6_diter_action next = xv6_diter_action_init;
     next.cont = 1;
 
-    struct dir_context *dc = ctx;
+    if (dnum % nents == 0) {
+        /* Entering a block; keep the window ahead of it. */
+        xv6_dir_ra(file, ictx, dnum / nents + 1);
+    }
+
     if (dnum < dc->pos) {
         return next;
     }
@@ -163,8 +681,13 @@ static struct xv6_diter_action readdir_callback(uint dnum, struct dirent *de,
         /* Empty entry */
         cont = true;
     } else {
-        cont = dir_emit(ctx, de->name, strnlen(de->name, DIRSIZ),
-                    __le16_to_cpu(de->inum), DT_UNKNOWN);
+        uint inum = __le16_to_cpu(de->inum);
+        cont = dir_emit(dc, de->name, strnlen(de->name, DIRSIZ),
+                    inum, xv6_dtype(fsinfo, inum));
+        if (cont && *ira) {
+            /* Lookups follow readdir here (ls -l): it will be stat'ed. */
+            xv6_ira_inode(sb, inum, last);
+        }
     }
     dc->pos = dnum + (int)cont;
     next.cont = cont;
@@ -195,8 +718,17 @@ static int xv6_readdir(struct file *dir, struct dir_context *ctx) {
     if ((error = xv6_init_ictx(&ictx, inode, &di)) != 0) {
         return error;
     }
-    int ret = xv6_dir_iterate(&fsinfo->check, &ictx, readdir_callback, ctx, 
+    uint last = 0;
+    /* d_type comes from itypes; only read inodes ahead for stat walks. */
+    const struct xv6_inode_info *ii = inode->i_private;
+    bool ira = ii && READ_ONCE(ii->ra_seq);
+    void *arr[6] = {ctx, sb, &last, dir, &ictx, &ira};
+    struct blk_plug plug;
+    blk_start_plug(&plug);
+    xv6_dir_ra(dir, &ictx, ctx->pos / (BSIZE / sizeof(struct dirent)));
+    int ret = xv6_dir_iterate(&fsinfo->check, &ictx, readdir_callback, arr, 
                     ctx->pos, false);
+    blk_finish_plug(&plug);
     return ret;
 }
 
@@ -238,10 +770,14 @@ static int xv6_dir_erase(struct inode *dir, const char *name) {
         return -ENOTDIR;
     }
 
-    void *ctx[2];
+    void *ctx[3];
     bool success = false;
-    ctx[0] = (void *) (uintptr_t) name;
+    uint erased = 0;
+    struct xv6_dname key;
+    xv6_dname_from_str(&key, name, strnlen(name, DIRSIZ));
+    ctx[0] = &key;
     ctx[1] = &success;
+    ctx[2] = &erased;
 
     struct super_block *sb = dir->i_sb;
     struct xv6_fs_info *fsinfo = sb->s_fs_info;
@@ -254,34 +790,367 @@ static int xv6_dir_erase(struct inode *dir, const char *name) {
         return error;
     }
 
+    /* The index knows where the entry is; start right there. */
+    uint start = 2, dnum = 0;
+    struct dirent de;
+    const bool hashed = xv6_dir_hashed(dir, &ictx);
+    if (hashed) {
+        error = xv6_hdir_find(check, &ictx, name, &dnum, &de);
+        if (error || !dnum) {
+            return error ? error : -ENOENT;
+        }
+        start = dnum;
+    } else if (xv6_dindex_lookup(dir, &key, &dnum, &de) && dnum) {
+        start = dnum;
+    }
     error = xv6_dir_iterate(check, &ictx, de_erase_callback, 
-                (void **) ctx, 2, false);
+                (void **) ctx, start, false);
     xv6_assert (!ictx.dirty && "dir erase should not mut inode");
+    if (success && !hashed) {
+        xv6_dindex_erase(dir, &key);
+        xv6_dfree_add(dir, erased);
+        if (!error && xv6_dir_sparse(dir)) {
+            /* Best effort; an open handle may well defer it. */
+            (void) xv6_dir_compact(dir, NULL);
+        }
+    }
     return success ? error : -ENOENT;
 
 }
 
-static struct xv6_diter_action rmtest_callback(uint dnum, struct dirent *de, void *ctx) {
-    bool *empty = ctx;
-    struct xv6_diter_action act = xv6_diter_action_init;
-    act.cont = true;
+static struct xv6_diter_action rename_scan_callback(uint dnum,
+            struct dirent *de, void *ctx) {
+    void **arr = ctx;
+    const struct xv6_dname *oldkey = arr[0];
+    const struct xv6_dname *newkey = arr[1];
+    uint *olddnum = arr[2];
+    uint *newdnum = arr[3];
 
-    if (dnum <= 1) {
-        return act;
+    struct xv6_diter_action next = xv6_diter_action_init;
+    next.cont = 1;
+    if (de->inum == 0) {
+        return next;
     }
+    struct xv6_dname name;
+    xv6_dname_from_dirent(&name, de);
+    if (xv6_dname_eq(oldkey, &name)) {
+        *olddnum = dnum;
+    } else if (xv6_dname_eq(newkey, &name)) {
+        *newdnum = dnum;
+        /* Cannot rename over it, no need to go on. */
+        next.cont = 0;
+    }
+    next.cont &= !*olddnum || !*newdnum;
+    return next;
+}
 
-    if (de->inum != 0) {
-        xv6_assert (de->name[0] != 0 && "empty name in dir entry");
-        *empty = false;
-        act.cont = false;
+static int xv6_dir_rename_local(struct inode *dir, const char *oldname,
+            const char *newname) {
+    struct super_block *sb = dir->i_sb;
+    struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    struct checker *check = &fsinfo->check;
+    const uint nents = BSIZE / sizeof(struct dirent);
+    struct dinode di;
+    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(dir);
+
+    int error = xv6_init_ictx(&ictx, dir, &di);
+    if (unlikely(error)) {
+        return error;
+    }
+    if (xv6_dir_hashed(dir, &ictx)) {
+        /* The new name most likely belongs to another bucket. */
+        return 1;
+    }
+
+    struct xv6_dname oldkey, newkey;
+    xv6_dname_from_str(&oldkey, oldname, strnlen(oldname, DIRSIZ));
+    xv6_dname_from_str(&newkey, newname, strnlen(newname, DIRSIZ));
+    uint olddnum = 0, newdnum = 0;
+    struct dirent de;
+    if (xv6_dindex_lookup(dir, &newkey, &newdnum, &de)) {
+        /* The index answers both without reading the directory. */
+        if (!newdnum) {
+            (void) xv6_dindex_lookup(dir, &oldkey, &olddnum, &de);
+        }
+    } else {
+        void *ctx[4] = {&oldkey, &newkey, &olddnum, &newdnum};
+        error = xv6_dir_iterate(check, &ictx, rename_scan_callback,
+                    ctx, 2, false);
+        xv6_assert (!ictx.dirty && "rename scan should not mut inode");
+        if (error) {
+            return error;
+        }
+    }
+    if (newdnum) {
+        return -EEXIST;
+    }
+    if (!olddnum) {
+        return -ENOENT;
     }
-    return act;
+
+    uint blockno;
+    error = xv6_inode_addr(check, &ictx, olddnum / nents, &blockno, false);
+    if (error || blockno == 0) {
+        return error ? error : -EIO;
+    }
+    struct buffer_head *bh = sb_bread(sb, blockno);
+    if (!bh) {
+        return -EIO;
+    }
+    struct dirent *deptr = (struct dirent *) bh->b_data + olddnum % nents;
+    strncpy(deptr->name, newname, DIRSIZ);
+    uint inum = __le16_to_cpu(deptr->inum);
+    mark_buffer_dirty(bh);
+    error = sync_dirty_buffer(bh);
+    brelse(bh);
+    if (!error) {
+        /* The slot stays where it is, so the free list is unchanged. */
+        xv6_dindex_erase(dir, &oldkey);
+        xv6_dindex_insert(dir, &newkey, olddnum, inum);
+    }
+    return error;
+}
+
+/* Are few enough slots live that the directory is worth compacting? */
+static bool xv6_dir_sparse(struct inode *dir) {
+    struct xv6_inode_info *ii = dir->i_private;
+    const uint nslots = dir->i_size / sizeof(struct dirent);
+    if (!ii || dir->i_size < XV6_DCOMPACT_MIN_SIZE) {
+        return false;
+    }
+    mutex_lock(&ii->dir_lock);
+    /* Only a complete free list tells how many slots are live. */
+    bool sparse = ii->dfree.complete && 
+                (nslots - ii->dfree.count) * XV6_DCOMPACT_RATIO < nslots;
+    mutex_unlock(&ii->dir_lock);
+    return sparse;
+}
+
+/* Release a block taken by xv6_dir_getblk, writing it if dirty. */
+static void xv6_dir_putblk(struct buffer_head **bhp, int *error) {
+    if (*bhp) {
+        int err = sync_dirty_buffer(*bhp);
+        *error = *error ? *error : err;
+        brelse(*bhp);
+        *bhp = NULL;
+    }
+}
+
+/* Read logical block `blk' of a directory; *bhp is NULL for a hole. */
+static int xv6_dir_getblk(struct checker *check, struct xv6_inode_ctx *ictx,
+            uint blk, struct buffer_head **bhp, bool alloc) {
+    uint blockno;
+    int error = xv6_inode_addr(check, ictx, blk, &blockno, alloc);
+    *bhp = NULL;
+    if (error || !blockno) {
+        return error;
+    }
+    *bhp = sb_bread(check->privat, blockno);
+    return *bhp ? 0 : -EIO;
+}
+
+static bool xv6_dir_unlink_moved(struct super_block *sb,
+            struct buffer_head *dbh, struct buffer_head *sbh,
+            u64 *copied, u64 *moved, int *error) {
+    const uint nents = BSIZE / sizeof(struct dirent);
+    bool cleared = false;
+    if (!*moved) {
+        return false;
+    }
+    /* Copies must reach the disk before the originals vanish. */
+    int err = *error ? *error : sync_dirty_buffer(dbh);
+    if (!err) {
+        for (uint i = 0; i < nents; i++) {
+            if (*moved & ((u64) 1 << i)) {
+                memset((struct dirent *) sbh->b_data + i, 0, 
+                            sizeof(struct dirent));
+            }
+        }
+        mark_buffer_dirty(sbh);
+        cleared = true;
+    } else {
+        /* Take the copies back, the originals are still in place. */
+        for (uint i = 0; i < nents; i++) {
+            if (*copied & ((u64) 1 << i)) {
+                memset((struct dirent *) dbh->b_data + i, 0, 
+                            sizeof(struct dirent));
+            }
+        }
+        mark_buffer_dirty(dbh);
+        if (sync_dirty_buffer(dbh)) {
+            xv6_fs_corrupted(sb, "compaction may have left an entry twice");
+        }
+    }
+    *error = *error ? *error : err;
+    *copied = *moved = 0;
+    return cleared;
+}
+
+static void xv6_dir_putsrc(struct super_block *sb, struct buffer_head **sbhp,
+            bool *cleared, int *error) {
+    int err = 0;
+    xv6_dir_putblk(sbhp, &err);
+    if (err && *cleared) {
+        /* The copies are on disk and the originals may be as well. */
+        xv6_fs_corrupted(sb, "compaction may have left an entry twice");
+    }
+    *cleared = false;
+    *error = *error ? *error : err;
+}
+
+static int xv6_dir_compact(struct inode *dir, struct file *self) {
+    struct xv6_inode_info *ii = dir->i_private;
+    if (unlikely(!ii)) {
+        return -ENOMEM;
+    }
+    if (atomic_read(&ii->nopen) > (self ? 1 : 0)) {
+        return -EBUSY;
+    }
+
+    struct xv6_fs_info *fsinfo = dir->i_sb->s_fs_info;
+    struct checker *check = &fsinfo->check;
+    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(dir);
+    ictx.addrs = ii->addrs;
+    if (xv6_dir_hashed(dir, &ictx)) {
+        /* Entries of a hashed directory cannot move. */
+        return -EOPNOTSUPP;
+    }
+
+    const uint nents = BSIZE / sizeof(struct dirent);
+    const uint nslots = dir->i_size / sizeof(struct dirent);
+    struct super_block *sb = dir->i_sb;
+    struct buffer_head *sbh = NULL, *dbh = NULL;
+    uint sblk = -1, dblk = -1, dst = 2 /* . and .. stay */;
+    /*
+     * Slots of sbh moved to the `copied' slots of dbh, cleared once the
+     * copies are on disk. `cleared' tells that sbh has such clears.
+     */
+    u64 moved = 0, copied = 0;
+    bool cleared = false;
+    const loff_t pos = self ? self->f_pos : 0;
+    loff_t newpos = pos;
+    int error = 0;
+    BUILD_BUG_ON(BSIZE / sizeof(struct dirent) > 64);
+    for (uint src = 2; src < nslots && !error; src++) {
+        if (src == pos) {
+            /* Entries keep their order, so the handle stays put. */
+            newpos = dst;
+        }
+        if (src / nents != sblk) {
+            cleared |= xv6_dir_unlink_moved(sb, dbh, sbh, &copied, &moved,
+                        &error);
+            xv6_dir_putsrc(sb, &sbh, &cleared, &error);
+            sblk = src / nents;
+            if (error || (error = xv6_dir_getblk(check, &ictx, sblk, 
+                            &sbh, false)) != 0) {
+                break;
+            }
+        }
+        if (!sbh) {
+            /* A hole: nothing is live in it. */
+            continue;
+        }
+        struct dirent *de = (struct dirent *) sbh->b_data + src % nents;
+        if (de->inum == 0) {
+            continue;
+        }
+        if (src != dst) {
+            if (dst / nents != dblk) {
+                cleared |= xv6_dir_unlink_moved(sb, dbh, sbh, &copied, 
+                            &moved, &error);
+                xv6_dir_putblk(&dbh, &error);
+                dblk = dst / nents;
+                if (error || (error = xv6_dir_getblk(check, &ictx, dblk,
+                                &dbh, true)) != 0) {
+                    break;
+                }
+            }
+            struct dirent *dd = (struct dirent *) dbh->b_data + dst % nents;
+            *dd = *de;
+            mark_buffer_dirty(dbh);
+            if (dbh == sbh) {
+                /* One block write moves it; no order to keep. */
+                memset(de, 0, sizeof(*de));
+            } else {
+                moved |= (u64) 1 << (src % nents);
+                copied |= (u64) 1 << (dst % nents);
+            }
+        }
+        dst++;
+    }
+    cleared |= xv6_dir_unlink_moved(sb, dbh, sbh, &copied, &moved, &error);
+    if (pos >= nslots) {
+        newpos = dst;
+    }
+    xv6_dir_putblk(&dbh, &error);
+    xv6_dir_putsrc(sb, &sbh, &cleared, &error);
+    if (error) {
+        /*
+         * Every entry is in exactly one place, or the file system went
+         * read-only above. The index and free list are stale.
+         */
+        xv6_dindex_drop(ii);
+        xv6_dfree_reset(ii);
+        return error;
+    }
+
+    const uint size = dst * sizeof(struct dirent);
+    error = xv6_inode_free_from(dir, (size + BSIZE - 1) / BSIZE);
+    dir->i_size = size;
+    int serr = xv6_sync_inode(dir);
+    error = error ? error : serr;
+
+    /* Every dnum may have changed, and no hole is left. */
+    xv6_dindex_drop(ii);
+    xv6_dfree_set_complete(dir);
+    if (self) {
+        self->f_pos = newpos;
+    }
+    return error;
+}
+
+static long xv6_dir_ioctl(struct file *file, unsigned int cmd,
+            unsigned long arg) {
+    struct inode *dir = file_inode(file);
+    int error;
+
+    switch (cmd) {
+        case XV6_IOC_COMPACT:
+            if (!inode_owner_or_capable(file_mnt_idmap(file), dir)) {
+                return -EPERM;
+            }
+            if ((error = mnt_want_write_file(file)) != 0) {
+                return error;
+            }
+            xv6_ilock_exclusive(dir);
+            error = xv6_dir_compact(dir, file);
+            xv6_iunlock_exclusive(dir);
+            mnt_drop_write_file(file);
+            return error;
+        default:
+            return -ENOTTY;
+    }
+}
+
+static int xv6_dir_open(struct inode *inode, struct file *file) {
+    struct xv6_inode_info *ii = inode->i_private;
+    if (ii) {
+        atomic_inc(&ii->nopen);
+    }
+    return 0;
+}
+
+static int xv6_dir_release(struct inode *inode, struct file *file) {
+    struct xv6_inode_info *ii = inode->i_private;
+    if (ii) {
+        atomic_dec(&ii->nopen);
+    }
+    return 0;
 }
 
 /* Test whether this directory can be safely removed. */
 static int xv6_dir_rmtest(struct inode *dir) {
 
-    bool ret = true;
     struct super_block *sb = dir->i_sb;
     struct xv6_fs_info *fsinfo = sb->s_fs_info;
     struct checker *check = &fsinfo->check;
@@ -293,14 +1162,13 @@ static int xv6_dir_rmtest(struct inode *dir) {
         return error;
     }
 
-    /* Iterate the directory in read-only fashion. */
-    error = xv6_dir_iterate(check, &ictx, rmtest_callback,
-                &ret, 2 /* skip . and .. */, false);
+    /* Scan the directory in read-only fashion. */
+    error = xv6_dir_empty(check, &ictx, 2 /* skip . and .. */);
     xv6_assert (!ictx.dirty && "should not mut inode");
-    if (error) {
+    if (error < 0) {
         return error;
     }
-    return ret ? 0 : -ENOTEMPTY;
+    return error ? 0 : -ENOTEMPTY;
 }
 
 static int xv6_rmdir(struct inode *dir, struct dentry *entry) {
@@ -1,5 +1,8 @@
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/lz4.h>
+#include <linux/mpage.h>
 
 #include "fs.h"
 #include "fsinfo.h"
@@ -7,14 +10,30 @@
 
 static const struct file_operations xv6_file_ops = {
     .owner = THIS_MODULE,
-    .read = xv6_file_read,
-    .write = xv6_file_write,
-    .llseek = xv6_lseek,
+    .open = xv6_file_open,
+    .mmap = xv6_file_mmap,
+    .llseek = xv6_llseek,
     .read_iter = xv6_file_read_iter,
-    .write_iter = generic_file_write_iter,
+    .write_iter = xv6_file_write_iter,
+    .splice_read = filemap_splice_read,
+    .splice_write = iter_file_splice_write,
     .iterate_shared = NULL,
     .fsync = xv6_file_sync,
-    .flush = xv6_file_flush,
+    .unlocked_ioctl = xv6_file_ioctl,
+    .compat_ioctl = xv6_file_ioctl,
+    .fop_flags = FOP_BUFFER_RASYNC,
+};
+
+static const struct file_operations xv6_zfile_ops = {
+    .owner = THIS_MODULE,
+    .open = xv6_zfile_open,
+    .mmap = generic_file_readonly_mmap,
+    .llseek = generic_file_llseek,
+    .read_iter = generic_file_read_iter,
+    .splice_read = filemap_splice_read,
+    .fsync = xv6_file_sync,
+    .unlocked_ioctl = xv6_file_ioctl,
+    .compat_ioctl = xv6_file_ioctl,
 };
 
 static const struct file_operations xv6_directory_ops = {
@@ -23,8 +42,11 @@ static const struct file_operations xv6_directory_ops = {
     .read = generic_read_dir,
     .read_iter = xv6_file_read_iter,
     .iterate_shared = xv6_readdir,
+    .unlocked_ioctl = xv6_dir_ioctl,
+    .compat_ioctl = xv6_dir_ioctl,
+    .open = xv6_dir_open,
+    .release = xv6_dir_release,
     .fsync = xv6_file_sync,
-    .flush = xv6_file_flush,
 };
 
 __attribute__((unused))
@@ -67,124 +89,722 @@ file_end:
     return 0;
 }
 
-static ssize_t xv6_file_read(struct file *file, char __user *buf,
-            size_t len, loff_t *ppos) {
-    struct inode *ino = file->f_inode;
-    ssize_t nread = 0;
-    loff_t cpos = *ppos;
-    uint block = cpos / BSIZE;
-    uint boff = cpos % BSIZE;
-    int error = 0;
-
-    /* Like ext4_file_read_iter, only lock(read) inode. */
-    xv6_ilock_shared(ino);
-    size_t file_size = ino->i_size;
-    loff_t rest = file_size - cpos;
-    if (len > rest) {
-        len = rest;
+static int xv6_get_block(struct inode *inode, sector_t iblock,
+            struct buffer_head *bh_result, int create) {
+    struct super_block *sb = inode->i_sb;
+    struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    struct dinode di;
+    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(inode);
+    struct xv6_run run;
+    uint nrun = 1;
+    if (iblock >= MAXFILE) {
+        return create ? -EFBIG : 0;
+    }
+    /* mpage and dio ask for as many blocks as b_size holds. */
+    const uint want = xv6_min(xv6_max(bh_result->b_size >> sb->s_blocksize_bits,
+                    (size_t) 1), (size_t) (MAXFILE - iblock));
+    int error = xv6_init_ictx(&ictx, inode, &di);
+    if (unlikely(error)) {
+        return error;
     }
 
-    struct buffer_head *bh = NULL;
-    while (len) {
-        error = xv6_inode_block(ino, block, &bh);
-        if (error) {
-            break;
+    error = xv6_inode_map(&fsinfo->check, &ictx, iblock, want,
+                &run, &nrun, false);
+    if (!error && nrun && run.pblk == 0 && create) {
+        /* write(2) holds i_rwsem, but page_mkwrite does not. */
+        struct xv6_inode_info *ii = inode->i_private;
+        if (unlikely(!ii)) {
+            return -ENOMEM;
         }
-        size_t to_read = BSIZE - boff;
-        if (to_read > len) {
-            to_read = len;
+        mutex_lock(&ii->map_lock);
+        /* Maps what another thread allocated meanwhile, if any. */
+        nrun = 1;
+        error = xv6_inode_map(&fsinfo->check, &ictx, iblock, want,
+                    &run, &nrun, true);
+        if (nrun && run.fresh) {
+            /* Not zeroed on disk: the page cache zeroes what is not written. */
+            set_buffer_new(bh_result);
         }
-        if (to_read > file_size - cpos) {
-            to_read = file_size - cpos;
+        if (ictx.dirty) {
+            mark_inode_dirty(inode);
         }
-        bool page_fault = false;
-        if (bh == NULL) {
-            /* 
-             * This is a virtual data block filled with 0. 
-             * Set user memory [buf, buf + to_read) to 0.
-             */
-            page_fault = clear_user(buf, to_read);
-        } else {
-            page_fault = copy_to_user(buf, bh->b_data + boff, to_read);
-            brelse(bh);
-            bh = NULL;
-        }
-        if (page_fault) {
-            error = -EFAULT;
+        mutex_unlock(&ii->map_lock);
+    }
+    if (nrun == 0) {
+        return error;
+    }
+    /* A short run still maps the blocks it got before the error. */
+    if (run.pblk) {
+        map_bh(bh_result, sb, run.pblk);
+    }
+    /* A whole run, or a whole hole, at once. */
+    bh_result->b_size = (size_t) run.len << sb->s_blocksize_bits;
+    return 0;
+}
+
+static int xv6_read_folio(struct file *file, struct folio *folio) {
+    return mpage_read_folio(folio, xv6_get_block);
+}
+
+static void xv6_readahead(struct readahead_control *rac) {
+    mpage_readahead(rac, xv6_get_block);
+}
+
+static int xv6_writepages(struct address_space *mapping,
+            struct writeback_control *wbc) {
+    return mpage_writepages(mapping, wbc, xv6_get_block);
+}
+
+static void xv6_write_failed(struct address_space *mapping, loff_t to) {
+    struct inode *inode = mapping->host;
+    if (to > inode->i_size && inode->i_private) {
+        truncate_pagecache(inode, inode->i_size);
+        (void) xv6_inode_free_from(inode, DIV_ROUND_UP(inode->i_size, BSIZE));
+    }
+}
+
+static int xv6_write_begin(const struct kiocb *iocb,
+            struct address_space *mapping, loff_t pos, unsigned len,
+            struct folio **foliop, void **fsdata) {
+    int error = block_write_begin(mapping, pos, len, foliop, xv6_get_block);
+    if (unlikely(error)) {
+        xv6_write_failed(mapping, pos + len);
+    }
+    return error;
+}
+
+static ssize_t xv6_direct_IO(struct kiocb *iocb, struct iov_iter *iter) {
+    struct address_space *mapping = iocb->ki_filp->f_mapping;
+    struct inode *inode = mapping->host;
+    size_t count = iov_iter_count(iter);
+    loff_t offset = iocb->ki_pos;
+
+    /*
+     * Holes inside i_size are not filled here (DIO_SKIP_HOLES); the
+     * write stops short and the rest falls back to buffered I/O.
+     */
+    ssize_t ret = blockdev_direct_IO(iocb, inode, iter, xv6_get_block);
+    if (ret < 0 && iov_iter_rw(iter) == WRITE) {
+        xv6_write_failed(mapping, offset + count);
+    }
+    return ret;
+}
+
+static ssize_t xv6_file_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    const int flags = IOCB_NOWAIT | IOCB_DIRECT;
+    if ((iocb->ki_flags & flags) == flags) {
+        return -EAGAIN;
+    }
+    if (!(iocb->ki_flags & IOCB_DIRECT)) {
+        return generic_file_read_iter(iocb, to);
+    }
+    /* The file may have been compressed since it was opened. */
+    struct inode *inode = file_inode(iocb->ki_filp);
+    const struct xv6_inode_info *ii = inode->i_private;
+    xv6_ilock_shared(inode);
+    if (ii && ii->zalg) {
+        iocb->ki_flags &= ~IOCB_DIRECT;
+    }
+    ssize_t ret = generic_file_read_iter(iocb, to);
+    xv6_iunlock_shared(inode);
+    return ret;
+}
+
+static bool xv6_range_trylock(struct xv6_inode_info *ii, struct xv6_range *r) {
+    struct xv6_range *it;
+    bool ok = true;
+    spin_lock(&ii->range_lock);
+    list_for_each_entry(it, &ii->ranges, node) {
+        if (it->start <= r->end && r->start <= it->end) {
+            ok = false;
             break;
         }
-        buf += to_read;
-        len -= to_read;
-        nread += to_read;
-        cpos += to_read;
-        boff = 0;
-        block += 1;
     }
-
-    xv6_iunlock_shared(ino);
-    if (error && nread <= 0) {
-        nread = error;
+    if (ok) {
+        list_add(&r->node, &ii->ranges);
     }
-    *ppos = cpos;
-    return nread;
+    spin_unlock(&ii->range_lock);
+    return ok;
+}
+
+static void xv6_range_lock(struct xv6_inode_info *ii, struct xv6_range *r) {
+    wait_event(ii->range_wait, xv6_range_trylock(ii, r));
 }
 
-static ssize_t xv6_file_write(struct file *file, const char __user *buf,
-            size_t len, loff_t *ppos) {
-    struct inode *ino = file->f_inode;
-    ssize_t nwrite = 0;
-    loff_t cpos = *ppos;
-    if (file->f_flags & O_APPEND) {
+static void xv6_range_unlock(struct xv6_inode_info *ii, struct xv6_range *r) {
+    spin_lock(&ii->range_lock);
+    list_del(&r->node);
+    spin_unlock(&ii->range_lock);
+    wake_up_all(&ii->range_wait);
+}
+
+/* Neither appends nor extends the file? */
+static inline bool xv6_write_inside(struct kiocb *iocb, struct iov_iter *from) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    return !(iocb->ki_flags & IOCB_APPEND) &&
+        iocb->ki_pos + iov_iter_count(from) <= i_size_read(inode);
+}
+
+static ssize_t xv6_file_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct xv6_inode_info *ii = inode->i_private;
+    bool shared = ii && xv6_write_inside(iocb, from);
+    bool ranged = false;
+    struct xv6_range range;
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
         /*
-         * When the file is opened with O_APPEND, write(2) will set
-         * file offset to the end.
-         * See man 2 open.
+         * generic_perform_write may sleep on the folio lock, on stable
+         * pages and in dirty throttling, an O_DSYNC write syncs inline,
+         * and direct I/O waits for its bios. As on ext4, the caller
+         * retries from a context that may block.
          */
-        cpos = ino->i_size;
+        return -EAGAIN;
+    }
+
+restart:
+    if (shared) {
+        inode_lock_shared(inode);
+        /* Only exclusive holders change i_size or drop suid bits. */
+        if (!xv6_write_inside(iocb, from) || !IS_NOSEC(inode)) {
+            inode_unlock_shared(inode);
+            shared = false;
+            goto restart;
+        }
+    } else {
+        inode_lock(inode);
     }
-    uint block = cpos / BSIZE;
-    uint boff = cpos % BSIZE;
-    struct buffer_head *bh = NULL;
-    int error = 0;
 
-    /* Like ext4_file_write_iter, only lock(write) inode. */
-    xv6_ilock_exclusive(ino);
-    while (len) {
-        error = xv6_inode_wblock(ino, block, &bh);
+    ret = generic_write_checks(iocb, from);
+    if (ret > 0 && shared) {
+        /* Overlapping writers still go one at a time. */
+        range.start = iocb->ki_pos;
+        range.end = iocb->ki_pos + ret - 1;
+        xv6_range_lock(ii, &range);
+        ranged = true;
+    }
+    if (ret > 0) {
+        ret = __generic_file_write_iter(iocb, from);
+    }
+    if (ranged) {
+        xv6_range_unlock(ii, &range);
+    }
+    if (shared) {
+        inode_unlock_shared(inode);
+    } else {
+        inode_unlock(inode);
+    }
+
+    if (ret > 0) {
+        ret = generic_write_sync(iocb, ret);
+    }
+    return ret;
+}
+
+static int xv6_file_sync(struct file *file, loff_t start, loff_t end, 
+            int datasync) {
+    struct inode *inode = file->f_inode;
+    int error = file_write_and_wait_range(file, start, end);
+    if (error) {
+        return error;
+    }
+    if (!datasync || (READ_ONCE(inode->i_state) & I_DIRTY_DATASYNC)) {
+        /* Goes through ->write_inode, and cleans the inode. */
+        error = sync_inode_metadata(inode, 1);
         if (error) {
+            return error;
+        }
+    }
+    return blkdev_issue_flush(inode->i_sb->s_bdev);
+}
+
+static loff_t xv6_llseek(struct file *file, loff_t offset, int whence) {
+    if (whence != SEEK_HOLE && whence != SEEK_DATA) {
+        return generic_file_llseek(file, offset, whence);
+    }
+
+    struct inode *inode = file->f_mapping->host;
+    struct xv6_fs_info *fsinfo = inode->i_sb->s_fs_info;
+    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(inode);
+    struct dinode di;
+    uint next;
+    loff_t pos;
+
+    /* write_begin and page_mkwrite allocate, so the map is exact. */
+    xv6_ilock_shared(inode);
+    loff_t size = i_size_read(inode);
+    int error = offset < 0 || offset >= size ? -ENXIO : 0;
+    if (!error) {
+        error = xv6_init_ictx(&ictx, inode, &di);
+    }
+    if (!error) {
+        error = xv6_inode_next(&fsinfo->check, &ictx, offset / BSIZE,
+                    whence == SEEK_DATA, &next);
+    }
+    if (!error) {
+        pos = xv6_max(offset, (loff_t) next * BSIZE);
+        if (whence == SEEK_HOLE) {
+            /* There is always a hole at the end of file. */
+            pos = xv6_min(pos, size);
+        } else if (pos >= size) {
+            error = -ENXIO;
+        }
+    }
+    xv6_iunlock_shared(inode);
+    if (error) {
+        return error;
+    }
+    return vfs_setpos(file, pos, inode->i_sb->s_maxbytes);
+}
+
+static vm_fault_t xv6_page_mkwrite(struct vm_fault *vmf) {
+    struct vm_area_struct *vma = vmf->vma;
+    struct inode *inode = file_inode(vma->vm_file);
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vma->vm_file);
+    filemap_invalidate_lock_shared(inode->i_mapping);
+    int error = block_page_mkwrite(vma, vmf, xv6_get_block);
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    sb_end_pagefault(inode->i_sb);
+    return error ? vmf_fs_error(error) : VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct xv6_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = xv6_page_mkwrite,
+};
+
+static int xv6_file_mmap(struct file *file, struct vm_area_struct *vma) {
+    file_accessed(file);
+    vma->vm_ops = &xv6_file_vm_ops;
+    return 0;
+}
+
+static int xv6_file_open(struct inode *inode, struct file *file) {
+    file->f_mode |= FMODE_CAN_ODIRECT | FMODE_NOWAIT;
+    return generic_file_open(inode, file);
+}
+
+static sector_t xv6_bmap(struct address_space *mapping, sector_t block) {
+    return generic_block_bmap(mapping, block, xv6_get_block);
+}
+
+static const struct address_space_operations xv6_aops = {
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = block_invalidate_folio,
+    .read_folio = xv6_read_folio,
+    .readahead = xv6_readahead,
+    .writepages = xv6_writepages,
+    .write_begin = xv6_write_begin,
+    .write_end = generic_write_end,
+    .migrate_folio = buffer_migrate_folio,
+    .bmap = xv6_bmap,
+    .direct_IO = xv6_direct_IO,
+};
+
+static int xv6_zfile_open(struct inode *inode, struct file *file) {
+    if (!(file->f_mode & FMODE_WRITE)) {
+        return generic_file_open(inode, file);
+    }
+    xv6_ilock_exclusive(inode);
+    int error = xv6_zfile_expand(inode);
+    xv6_iunlock_exclusive(inode);
+    if (error) {
+        return error;
+    }
+    /* Both tables belong to this module, so open's reference holds. */
+    file->f_op = &xv6_file_ops;
+    return xv6_file_open(inode, file);
+}
+
+static int xv6_zread_cluster(struct inode *inode, uint c, char *dst) {
+    struct super_block *sb = inode->i_sb;
+    struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    const struct xv6_inode_info *ii = inode->i_private;
+    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(inode);
+    struct dinode di;
+    struct xv6_run runs[8];
+    uint pblk[1u << XV6_ZSHIFT_MAX] = { 0 };
+    const uint first = c << ii->zshift;
+    const size_t csize = (size_t) BSIZE << ii->zshift;
+    const loff_t pos = (loff_t) c * csize;
+    const loff_t size = i_size_read(inode);
+    const size_t len = pos < size ? xv6_min((loff_t) csize, size - pos) : 0;
+    const uint nblk = DIV_ROUND_UP(len, BSIZE);
+
+    memset(dst, 0, csize);
+    if (nblk == 0) {
+        return 0;
+    }
+    int error = xv6_init_ictx(&ictx, inode, &di);
+    for (uint i = first; !error && i < first + nblk; ) {
+        uint nrun = ARRAY_SIZE(runs);
+        error = xv6_inode_map(&fsinfo->check, &ictx, i, first + nblk - i,
+                    runs, &nrun, false);
+        if (error || nrun == 0) {
             break;
         }
-        size_t to_write = BSIZE - boff;
-        to_write = xv6_min(to_write, len);
-        bool page_fault = copy_from_user(bh->b_data + boff, buf, to_write);
-        if (page_fault) {
-            /* wrote something before */
-            error = -EFAULT;
-            mark_buffer_dirty(bh);
-            (void) sync_dirty_buffer(bh);
-            brelse(bh);
+        for (uint k = 0; k < nrun; k++) {
+            for (uint j = 0; runs[k].pblk && j < runs[k].len; j++) {
+                pblk[runs[k].lblk - first + j] = runs[k].pblk + j;
+            }
+            i = runs[k].lblk + runs[k].len;
+        }
+    }
+    if (error || pblk[0] == 0) {
+        return error;
+    }
+
+    /* A full map means the cluster did not compress. */
+    const bool raw = pblk[nblk - 1] != 0;
+    char *buf = raw ? dst : kvmalloc(csize, GFP_NOFS);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    uint n = 0;
+    for (; n < nblk && pblk[n]; n++) {
+        struct buffer_head *bh = sb_bread(sb, pblk[n]);
+        if (!bh) {
+            error = -EIO;
             break;
         }
-        mark_buffer_dirty(bh);
-        error = sync_dirty_buffer(bh);
-        brelse(bh); 
-        if (error) { break; }
-        bh = NULL;
-        buf += to_write;
-        len -= to_write;
-        nwrite += to_write;
-        cpos += to_write;
-        boff = 0;
-        block += 1;
+        memcpy(buf + n * BSIZE, bh->b_data, BSIZE);
+        brelse(bh);
+    }
+    if (raw) {
+        memset(dst + len, 0, csize - len);
+        return error;
+    }
+
+    const uint clen = __le32_to_cpu(((struct xv6_zhdr *) buf)->clen);
+    if (!error && (clen > n * BSIZE - sizeof(struct xv6_zhdr) ||
+                LZ4_decompress_safe(buf + sizeof(struct xv6_zhdr), dst,
+                    clen, len) != (int) len)) {
+        xv6_error("inode %lu: bad compressed cluster %u", inode->i_ino, c);
+        error = -EIO;
+    }
+    kvfree(buf);
+    return error;
+}
+
+static int xv6_zfill_folio(struct inode *inode, struct folio *folio,
+            struct xv6_zbuf *zb) {
+    const struct xv6_inode_info *ii = inode->i_private;
+    const size_t csize = (size_t) BSIZE << ii->zshift;
+    const loff_t pos = folio_pos(folio);
+    int error = 0;
+
+    for (size_t off = 0; !error && off < folio_size(folio); ) {
+        const uint c = (pos + off) / csize;
+        const size_t coff = (pos + off) % csize;
+        const size_t n = xv6_min(csize - coff, folio_size(folio) - off);
+        if (!zb->valid || zb->c != c) {
+            error = xv6_zread_cluster(inode, c, zb->buf);
+            zb->c = c;
+            zb->valid = error == 0;
+        }
+        if (!error) {
+            memcpy_to_folio(folio, off, zb->buf + coff, n);
+        }
+        off += n;
+    }
+    return error;
+}
+
+static int xv6_zread_folio(struct file *file, struct folio *folio) {
+    struct inode *inode = folio->mapping->host;
+    const struct xv6_inode_info *ii = inode->i_private;
+    struct xv6_zbuf zb = { 
+        .buf = kvmalloc((size_t) BSIZE << ii->zshift, GFP_NOFS),
+    };
+    int error = zb.buf ? xv6_zfill_folio(inode, folio, &zb) : -ENOMEM;
+    kvfree(zb.buf);
+    folio_end_read(folio, error == 0);
+    return error;
+}
+
+static void xv6_zreadahead(struct readahead_control *rac) {
+    struct inode *inode = rac->mapping->host;
+    const struct xv6_inode_info *ii = inode->i_private;
+    struct xv6_zbuf zb = { 
+        .buf = kvmalloc((size_t) BSIZE << ii->zshift, GFP_NOFS),
+    };
+    struct folio *folio;
+    if (!zb.buf) {
+        /* read_pages drops what is left; read_folio reads it later. */
+        return;
+    }
+    while ((folio = readahead_folio(rac)) != NULL) {
+        folio_end_read(folio, xv6_zfill_folio(inode, folio, &zb) == 0);
+    }
+    kvfree(zb.buf);
+}
+
+static const struct address_space_operations xv6_zaops = {
+    .read_folio = xv6_zread_folio,
+    .readahead = xv6_zreadahead,
+};
+
+static int xv6_zput(struct super_block *sb, uint *addrs,
+            struct buffer_head **ibh, uint lblk, const char *data) {
+    uint block = 0;
+    int error = 0;
+    if (lblk >= NDIRECT && *ibh == NULL) {
+        if ((error = xv6_balloc(sb, &addrs[NDIRECT])) != 0) {
+            return error;
+        }
+        if (!addrs[NDIRECT]) {
+            return -ENOSPC;
+        }
+        if ((*ibh = sb_bread(sb, addrs[NDIRECT])) == NULL) {
+            return -EIO;
+        }
+    }
+    if ((error = xv6_balloc_data(sb, &block)) != 0) {
+        return error;
+    }
+    if (!block) {
+        return -ENOSPC;
+    }
+    if (lblk < NDIRECT) {
+        addrs[lblk] = block;
+    } else {
+        ((__le32 *) (*ibh)->b_data)[lblk - NDIRECT] = __cpu_to_le32(block);
+    }
+
+    struct buffer_head *bh = sb_getblk(sb, block);
+    if (!bh) {
+        return -ENOMEM;
+    }
+    lock_buffer(bh);
+    memcpy(bh->b_data, data, BSIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    error = sync_dirty_buffer(bh);
+    brelse(bh);
+    return error;
+}
+
+static void xv6_zfree_map(struct super_block *sb, const uint *addrs,
+            struct buffer_head *ibh) {
+    for (int i = 0; i < NDIRECT + 1; i++) {
+        if (addrs[i]) {
+            (void) xv6_bfree(sb, addrs[i]);
+        }
+    }
+    for (int i = 0; ibh && i < NINDIRECT; i++) {
+        const uint block = __le32_to_cpu(((__le32 *) ibh->b_data)[i]);
+        if (block) {
+            (void) xv6_bfree(sb, block);
+        }
+    }
+    brelse(ibh);
+}
+
+static int xv6_zswap_map(struct inode *inode, uint *addrs,
+            struct buffer_head *ibh, uchar zalg, uchar zshift) {
+    struct super_block *sb = inode->i_sb;
+    struct address_space *mapping = inode->i_mapping;
+    struct xv6_inode_info *ii = inode->i_private;
+    struct buffer_head *old = NULL;
+    uint nold = 0;
+    int error = 0;
+
+    if (ii->addrs[NDIRECT] && !(old = sb_bread(sb, ii->addrs[NDIRECT]))) {
+        error = -EIO;
+    }
+    for (int i = 0; !error && i < NDIRECT + 1; i++) {
+        nold += ii->addrs[i] != 0;
+    }
+    for (int i = 0; old && i < NINDIRECT; i++) {
+        nold += ((__le32 *) old->b_data)[i] != 0;
+    }
+    if (!error) {
+        error = xv6_bfree_reserve(inode, nold);
+    }
+    if (!error && ibh) {
+        mark_buffer_dirty(ibh);
+        error = sync_dirty_buffer(ibh);
+    }
+    if (error) {
+        xv6_zfree_map(sb, addrs, ibh);
+        brelse(old);
+        return error;
+    }
+    brelse(ibh);
+
+    /* Page cache fills hold this shared, so none sees half a switch. */
+    filemap_invalidate_lock(mapping);
+    /* Cached folios may carry buffers of the old blocks. */
+    truncate_pagecache(inode, 0);
+    for (int i = 0; i < NDIRECT + 1; i++) {
+        if (ii->addrs[i]) {
+            xv6_bfree_later(inode, ii->addrs[i]);
+        }
+    }
+    for (int i = 0; old && i < NINDIRECT; i++) {
+        const uint block = __le32_to_cpu(((__le32 *) old->b_data)[i]);
+        if (block) {
+            xv6_bfree_later(inode, block);
+        }
+    }
+    brelse(old);
+    memcpy(ii->addrs, addrs, sizeof(ii->addrs));
+    ii->zalg = zalg;
+    ii->zshift = zshift;
+    inode->i_fop = zalg ? &xv6_zfile_ops : &xv6_file_ops;
+    mapping->a_ops = zalg ? &xv6_zaops : &xv6_aops;
+    /* The old blocks are freed once this write no longer points at them. */
+    error = xv6_sync_inode(inode);
+    filemap_invalidate_unlock(mapping);
+    return error;
+}
+
+static int xv6_zfile_expand(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct xv6_inode_info *ii = inode->i_private;
+    if (!ii->zalg) {
+        /* Another writer got here first. */
+        return 0;
+    }
+    const uint nblocks = DIV_ROUND_UP((u64) i_size_read(inode), BSIZE);
+    const uint cblocks = 1u << ii->zshift;
+    uint addrs[NDIRECT + 1] = { 0 };
+    struct buffer_head *ibh = NULL;
+    char *buf = kvmalloc((size_t) BSIZE << ii->zshift, GFP_KERNEL);
+    int error = buf ? 0 : -ENOMEM;
+
+    for (uint c = 0; !error && c * cblocks < nblocks; c++) {
+        error = xv6_zread_cluster(inode, c, buf);
+        for (uint j = 0; !error && j < cblocks; j++) {
+            const uint lblk = c * cblocks + j;
+            const char *data = buf + j * BSIZE;
+            if (lblk < nblocks && memchr_inv(data, 0, BSIZE)) {
+                error = xv6_zput(sb, addrs, &ibh, lblk, data);
+            }
+        }
+    }
+    kvfree(buf);
+    if (error) {
+        xv6_zfree_map(sb, addrs, ibh);
+        return error;
+    }
+    return xv6_zswap_map(inode, addrs, ibh, 0, 0);
+}
+
+static int xv6_zfile_compress(struct inode *inode, uint shift) {
+    struct super_block *sb = inode->i_sb;
+    struct xv6_inode_info *ii = inode->i_private;
+    const loff_t size = i_size_read(inode);
+    const uint nblocks = DIV_ROUND_UP((u64) size, BSIZE);
+    const size_t csize = (size_t) BSIZE << shift;
+    const size_t hdr = sizeof(struct xv6_zhdr);
+    uint addrs[NDIRECT + 1] = { 0 };
+    struct buffer_head *ibh = NULL;
+
+    if (ii->zalg) {
+        return 0;
+    }
+    int error = filemap_write_and_wait(inode->i_mapping);
+    if (error) {
+        return error;
+    }
+    char *src = kvmalloc(csize, GFP_KERNEL);
+    char *zbuf = kvmalloc(csize, GFP_KERNEL);
+    void *wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    if (!src || !zbuf || !wrkmem) {
+        error = -ENOMEM;
+    }
+
+    for (uint c = 0; !error && ((u64) c << shift) < nblocks; c++) {
+        const loff_t pos = (loff_t) c * csize;
+        const size_t len = xv6_min((loff_t) csize, size - pos);
+        const uint nblk = DIV_ROUND_UP(len, BSIZE);
+        memset(src, 0, csize);
+        /* Read through the page cache, which the buffers may be behind. */
+        for (size_t off = 0; !error && off < len; ) {
+            struct folio *folio = read_mapping_folio(inode->i_mapping,
+                        (pos + off) >> PAGE_SHIFT, NULL);
+            if (IS_ERR(folio)) {
+                error = PTR_ERR(folio);
+                break;
+            }
+            const size_t foff = offset_in_folio(folio, pos + off);
+            const size_t n = xv6_min(folio_size(folio) - foff, len - off);
+            memcpy_from_folio(src + off, folio, foff, n);
+            folio_put(folio);
+            off += n;
+        }
+        if (error || !memchr_inv(src, 0, len)) {
+            /* An all-zero cluster is left a hole. */
+            continue;
+        }
+
+        /* Keep the compressed form only if it saves a block. */
+        int clen = nblk < 2 ? 0 : LZ4_compress_default(src, zbuf + hdr,
+                    len, (nblk - 1) * BSIZE - hdr, wrkmem);
+        const char *out = src;
+        uint nout = nblk;
+        if (clen > 0) {
+            ((struct xv6_zhdr *) zbuf)->clen = __cpu_to_le32(clen);
+            nout = DIV_ROUND_UP(hdr + clen, BSIZE);
+            memset(zbuf + hdr + clen, 0, nout * BSIZE - hdr - clen);
+            out = zbuf;
+        }
+        for (uint j = 0; !error && j < nout; j++) {
+            error = xv6_zput(sb, addrs, &ibh, (c << shift) + j,
+                        out + j * BSIZE);
+        }
+    }
+    kvfree(src);
+    kvfree(zbuf);
+    kvfree(wrkmem);
+    if (error) {
+        xv6_zfree_map(sb, addrs, ibh);
+        return error;
     }
+    return xv6_zswap_map(inode, addrs, ibh, XV6_ZALG_LZ4, shift);
+}
+
+static long xv6_file_ioctl(struct file *file, unsigned int cmd,
+            unsigned long arg) {
+    struct inode *inode = file_inode(file);
+    struct xv6_fs_info *fsinfo = inode->i_sb->s_fs_info;
+    int error;
 
-    ino->i_size = xv6_max(ino->i_size, cpos);
-    xv6_iunlock_exclusive(ino);
-    *ppos = cpos;
-    if (error && nwrite <= 0) {
-        nwrite = error;
+    switch (cmd) {
+        case XV6_IOC_ZCOMPRESS:
+            if (!(fsinfo->features & XV6_FEATURE_ZFILE)) {
+                return -EOPNOTSUPP;
+            }
+            arg = arg ? arg : XV6_ZSHIFT_DEFAULT;
+            if (arg < XV6_ZSHIFT_MIN || arg > XV6_ZSHIFT_MAX) {
+                return -EINVAL;
+            }
+            if (!inode_owner_or_capable(file_mnt_idmap(file), inode)) {
+                return -EPERM;
+            }
+            if ((error = mnt_want_write_file(file)) != 0) {
+                return error;
+            }
+            /* As deny_write_access: no writer may open it meanwhile. */
+            if (!atomic_dec_unless_positive(&inode->i_writecount)) {
+                mnt_drop_write_file(file);
+                return -ETXTBSY;
+            }
+            xv6_ilock_exclusive(inode);
+            error = xv6_zfile_compress(inode, arg);
+            xv6_iunlock_exclusive(inode);
+            atomic_inc(&inode->i_writecount);
+            mnt_drop_write_file(file);
+            return error;
+        default:
+            return -ENOTTY;
     }
-    return nwrite;
 }
 
 static int xv6_unlink(struct inode *dir, struct dentry *entry) {
@@ -264,13 +884,16 @@ static int xv6_rename (struct mnt_idmap *idmap, struct inode *olddir,
         goto rename_fini;
     }
 
-    /* Remove the entry in olddir. */
-    error = xv6_dir_erase(olddir, oldname);
-    if (error) {
-        goto rename_fini;
+    struct inode *oldino = oldentry->d_inode;
+    if (olddir == newdir) {
+        /* Only the name changes. */
+        error = xv6_dir_rename_local(olddir, oldname, newname);
+        if (error <= 0) {
+            goto rename_done;
+        }
     }
 
-    /* Test or remove in new entry */
+    /* Test the new entry first, so that nothing is lost on EEXIST. */
     struct dirent dummy;
     error = xv6_find_inum(newdir, newentry->d_name.name, &dnum, &dummy);
     if (error) {
@@ -282,13 +905,19 @@ static int xv6_rename (struct mnt_idmap *idmap, struct inode *olddir,
         return -EEXIST;
     }
 
+    /* Remove the entry in olddir. */
+    error = xv6_dir_erase(olddir, oldname);
+    if (error) {
+        goto rename_fini;
+    }
+
     /* 
      * Now the newentry in newdir is removed, 
      * can safely insert without check. 
      */
     /* Insert oldentry to newdir.  */
-    struct inode *oldino = oldentry->d_inode;
     error = xv6_dentry_insert(newdir, newname, oldino->i_ino);
+rename_done:
     if (!error) {
         d_instantiate(newentry, oldino);
     }
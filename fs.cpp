@@ -75,90 +75,512 @@ int xv6_inode_addr(struct checker *check, struct xv6_inode_ctx *inode,
     return error;
 }
 
+int xv6_inode_map(struct checker *check, struct xv6_inode_ctx *inode,
+            uint first, uint count, struct xv6_run *runs, uint *nrun,
+            bool alloc) {
+    const uint cap = *nrun;
+    *nrun = 0;
+    inode->dirty = false;
+    if (first >= MAXFILE || count > MAXFILE - first) {
+        if (alloc) { return -EFBIG; }
+        count = first >= MAXFILE ? 0 : MAXFILE - first;
+    }
+
+    uint *addrs = inode->addrs;
+    void *sb = check->privat;
+    struct bufptr indir_buf(nullptr, check);
+    uint *data = nullptr;
+    bool indir_dirty = false;
+    int error = 0;
+    for (uint i = first; i < first + count; i++) {
+        if (i >= NDIRECT && data == nullptr) {
+            if (addrs[NDIRECT] == 0 && !alloc) {
+                /* All the rest is a hole. */
+                struct xv6_run *r = *nrun ? &runs[*nrun - 1] : nullptr;
+                if (r && r->pblk == 0 && r->lblk + r->len == i) {
+                    r->len += first + count - i;
+                } else if (*nrun < cap) {
+                    runs[(*nrun)++] = {i, 0, first + count - i, false};
+                }
+                break;
+            }
+            if (addrs[NDIRECT] == 0) {
+                if (*nrun == cap) { break; }
+                error = check->balloc(sb, &addrs[NDIRECT]);
+                if (!error && addrs[NDIRECT] == 0) { error = -ENOSPC; }
+                if (error) { break; }
+                inode->dirty = true;
+            }
+            indir_buf.buf_ = check->bread(sb, addrs[NDIRECT]);
+            if (indir_buf.buf_ == nullptr) {
+                error = -EIO;
+                break;
+            }
+            data = reinterpret_cast<uint *>(indir_buf.data());
+        }
+
+        uint pblk = i < NDIRECT ? addrs[i] : __le32_to_cpu(data[i - NDIRECT]);
+        struct xv6_run *r = *nrun ? &runs[*nrun - 1] : nullptr;
+        if (r && r->lblk + r->len == i && !r->fresh &&
+                    (pblk ? r->pblk && r->pblk + r->len == pblk : !r->pblk)) {
+            r->len++;
+            continue;
+        }
+        /* Only a fresh block right after a fresh run can join it. */
+        const bool may_extend = pblk == 0 && alloc && r && r->fresh &&
+                    r->lblk + r->len == i;
+        if (*nrun == cap && !may_extend) {
+            /* Never allocate a block that no run can report. */
+            break;
+        }
+        bool fresh = false;
+        if (pblk == 0 && alloc) {
+            error = check->balloc_data(sb, &pblk);
+            if (!error && pblk == 0) { error = -ENOSPC; }
+            if (error) { break; }
+            const bool extends = may_extend && r->pblk + r->len == pblk;
+            if (!extends && *nrun == cap) {
+                /* Not contiguous after all, and there is no run left. */
+                (void) check->bfree(sb, pblk);
+                break;
+            }
+            if (i < NDIRECT) {
+                addrs[i] = pblk;
+                inode->dirty = true;
+            } else {
+                data[i - NDIRECT] = __cpu_to_le32(pblk);
+                indir_dirty = true;
+            }
+            if (extends) {
+                r->len++;
+                continue;
+            }
+            fresh = true;
+        }
+        runs[(*nrun)++] = {i, pblk, 1, fresh};
+    }
+
+    if (indir_dirty) {
+        int err = check->bflush(sb, indir_buf.buf_);
+        error = error ? error : err;
+    }
+    return error;
+}
+
+int xv6_inode_next(struct checker *check, struct xv6_inode_ctx *inode,
+            uint i, bool data, uint *next) {
+    const uint *addrs = inode->addrs;
+    *next = MAXFILE;
+    for (; i < NDIRECT; i++) {
+        if ((addrs[i] != 0) == data) {
+            *next = i;
+            return 0;
+        }
+    }
+    if (i >= MAXFILE) {
+        return 0;
+    }
+    if (addrs[NDIRECT] == 0) {
+        /* No indirect block: all the rest is a hole. */
+        *next = data ? MAXFILE : i;
+        return 0;
+    }
+
+    struct bufptr indir_buf(check->bread(check->privat, addrs[NDIRECT]), check);
+    if (indir_buf.buf_ == nullptr) { return -EIO; }
+    const uint *data_addrs = reinterpret_cast<const uint *>(indir_buf.data());
+    for (; i < MAXFILE; i++) {
+        if ((__le32_to_cpu(data_addrs[i - NDIRECT]) != 0) == data) {
+            *next = i;
+            break;
+        }
+    }
+    return 0;
+}
+
 int xv6_dir_iterate(struct checker *check,
             struct xv6_inode_ctx *dir, 
             xv6_diter_callback callback, /* iteration callback. */
             void *ctx /* context should be passed to callback. */,
             uint off, /* offset in entries. */
             bool rw) {
-    auto size = dir->size;
-    if (size % sizeof(struct dirent) != 0 || size < 2 * sizeof(struct dirent)) {
-        check->panic("xv6: dir has incorrect size");
+    auto fn = [callback, ctx](uint dnum, struct dirent *de) {
+        return callback(dnum, de, ctx);
+    };
+    return xv6_dir_iterate_t(check, dir, fn, off, rw);
+}
+
+static uint xv6_namelen(const char *name) {
+    uint len = 0;
+    while (len < DIRSIZ && name[len]) {
+        len++;
+    }
+    return len;
+}
+
+static_assert(sizeof(struct dirent) == 2 * sizeof(unsigned long long),
+            "dirent scan loads an entry as two words");
+
+uint xv6_dblock_find(const struct dirent *des, uint from, uint to,
+            const struct xv6_dname *key) {
+    /*
+     * Lay the key out as a dirent: a name equals the key iff its first
+     * len + 1 bytes do (strncmp semantic), whatever follows the NUL.
+     * The inode number is masked out and tested apart.
+     */
+    const uchar *name = (const uchar *) key;
+    uchar kb[sizeof(struct dirent)] = {0};
+    uchar mb[sizeof(struct dirent)] = {0};
+    const uint base = __builtin_offsetof(struct dirent, name);
+    const uint ncmp = xv6_min(xv6_namelen((const char *) name) + 1,
+                (uint) DIRSIZ);
+    for (uint i = 0; i < ncmp; i++) {
+        kb[base + i] = name[i];
+        mb[base + i] = 0xff;
+    }
+    unsigned long long k[2], m[2];
+    __builtin_memcpy(k, kb, sizeof(k));
+    __builtin_memcpy(m, mb, sizeof(m));
+
+    for (uint i = from; i < to; i++) {
+        unsigned long long w[2];
+        __builtin_memcpy(w, &des[i], sizeof(w));
+        if ((((w[0] ^ k[0]) & m[0]) | ((w[1] ^ k[1]) & m[1])) == 0 &&
+                    des[i].inum != 0) {
+            return i;
+        }
     }
+    return to;
+}
+
+/*
+ * Call fn(deptr, dnum0, from, to) on the mapped blocks of dir from entry
+ * `off' on, with entries [from, to) of each block valid, until fn
+ * returns true. The block map is read one batch of runs at a time.
+ * @return 1 if fn stopped it, 0 if it reached the end; -ERR on error.
+ */
+template <typename _Fn>
+static int xv6_dir_scan(struct checker *check, struct xv6_inode_ctx *dir,
+            uint off, _Fn &&fn) {
     const uint nents = BSIZE / sizeof(struct dirent);
-    size /= sizeof(struct dirent);
+    const uint size = dir->size / sizeof(struct dirent);
+    const uint nblocks = (size + nents - 1) / nents;
+    struct xv6_run runs[8];
+    uint i = off / nents;
+    while (i < nblocks) {
+        uint nrun = sizeof(runs) / sizeof(runs[0]);
+        int error = xv6_inode_map(check, dir, i, nblocks - i, runs, &nrun, false);
+        if (error) { return error; }
+        if (nrun == 0) { break; }
+        for (uint r = 0; r < nrun; r++) {
+            i = runs[r].lblk + runs[r].len;
+            if (runs[r].pblk == 0) { continue; }
+            for (uint j = 0; j < runs[r].len; j++) {
+                const uint blk = runs[r].lblk + j;
+                struct bufptr bp(check->bread(check->privat, runs[r].pblk + j), check);
+                if (bp.buf_ == nullptr) { return -EIO; }
+                const uint from = xv6_max(off, blk * nents) - blk * nents;
+                const uint to = xv6_min(nents, size - blk * nents);
+                if (fn((const struct dirent *) bp.data(), blk * nents, from, to)) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
 
-    if (off > size) {
-        /* Reached the end. should check to avoid underflow */
+int xv6_dir_find(struct checker *check, struct xv6_inode_ctx *dir,
+            const struct xv6_dname *key, uint off,
+            uint *dnum, struct dirent *de) {
+    *dnum = 0;
+    auto find = [key, dnum, de](const struct dirent *deptr, uint dnum0,
+                uint from, uint to) {
+        uint k = xv6_dblock_find(deptr, from, to, key);
+        if (k < to) {
+            *de = deptr[k];
+            *dnum = dnum0 + k;
+        }
+        return k < to;
+    };
+    int error = xv6_dir_scan(check, dir, off, find);
+    return error < 0 ? error : 0;
+}
+
+int xv6_dir_empty(struct checker *check, struct xv6_inode_ctx *dir,
+            uint off) {
+    auto used = [](const struct dirent *deptr, uint dnum0,
+                uint from, uint to) {
+        /* No early exit, the whole block is one pass of OR. */
+        uint used = 0;
+        for (uint k = from; k < to; k++) {
+            used |= deptr[k].inum;
+        }
+        return used != 0;
+    };
+    int error = xv6_dir_scan(check, dir, off, used);
+    return error < 0 ? error : !error;
+}
+
+int xv6_hdir_head(struct checker *check, struct xv6_inode_ctx *dir,
+            struct xv6_hdir *head) {
+    const uint slot = XV6_HDIR_SLOT;
+    if (dir->size < BSIZE || dir->size % BSIZE != 0) {
+        /* Hashed directories are made of whole blocks. */
         return 0;
     }
-    size -= off;
+    uint blockno;
+    int error = xv6_inode_addr(check, dir, 0, &blockno, false);
+    if (error || blockno == 0) {
+        return error;
+    }
+    struct bufptr bp(check->bread(check->privat, blockno), check);
+    if (bp.buf_ == nullptr) { return -EIO; }
+    struct dirent *deptr = (struct dirent *) bp.data();
+    __builtin_memcpy(head, &deptr[slot], sizeof(*head));
+    return head->inum == 0 && head->name0 == 0 && 
+                head->magic == XV6_HDIR_MAGIC;
+}
+
+int xv6_hdir_find(struct checker *check, struct xv6_inode_ctx *dir,
+            const char *name, uint *dnum, struct dirent *de) {
+    const uint nents = BSIZE / sizeof(struct dirent);
+    *dnum = 0;
+    struct xv6_hdir head;
+    int error = xv6_hdir_head(check, dir, &head);
+    if (error <= 0) {
+        return error ? error : -EINVAL;
+    }
 
-    bool alloc = rw /* read-write enabled. */;
-    uint i = off / nents;
-    off = off % nents;
-    struct xv6_diter_action act = xv6_diter_action_init;
-    int error;
+    struct xv6_dname key;
+    xv6_dname_from_str(&key, name, xv6_namelen(name));
+    uint bucket = xv6_hdir_bucket(head.level, __le16_to_cpu(head.split),
+                xv6_hdir_hash((const char *) &key, __le32_to_cpu(head.seed)));
     uint blockno;
-    while ((error = xv6_inode_addr(check, dir, i, &blockno, alloc)) == 0) {
-        const uint lim = xv6_min(nents, size + off);
-        if (blockno == 0) {
-            uchar dummy[sizeof(struct dirent)] = {0};
-            /* Most callback relies on it only called once. */
-            act = callback(i * nents, (struct dirent *) &dummy, ctx);
-            if (act.de_dirty) {
-                check->warning("%s dentry should not be dirty", check->warn);
-            }
-            if (!act.cont) {
-                break;
-            }
-        } else {
-            struct bufptr debuf (check->bread(check->privat, blockno), check);
-            if (debuf.buf_ == nullptr) {
-                error = -EIO;
-                break;
-            }
-            struct dirent *deptr = (struct dirent *) debuf.data();
-            bool flush = false;
-            for (uint k = off; k < lim; k++) {
-                act = callback(i * nents + k, &deptr[k], ctx);
-                flush |= act.de_dirty;
-                if (!act.cont) {
-                    break;
-                }
+    error = xv6_inode_addr(check, dir, 1 + bucket, &blockno, false);
+    if (error) {
+        return error;
+    }
+    if (blockno != 0) {
+        struct bufptr bp(check->bread(check->privat, blockno), check);
+        if (bp.buf_ == nullptr) { return -EIO; }
+        const struct dirent *deptr = (const struct dirent *) bp.data();
+        uint k = xv6_dblock_find(deptr, 0, nents, &key);
+        if (k < nents) {
+            *de = deptr[k];
+            *dnum = (1 + bucket) * nents + k;
+            return 0;
+        }
+    }
+    if (head.flags & XV6_HDIR_SPILL) {
+        /* Not in its bucket, but it may have spilled anywhere. */
+        return xv6_dir_find(check, dir, &key, XV6_HDIR_SLOT + 1, dnum, de);
+    }
+    return 0;
+}
+
+/* Write the header back to block 0. */
+static int xv6_hdir_sync_head(struct checker *check, struct xv6_inode_ctx *dir,
+            const struct xv6_hdir *head) {
+    uint blockno;
+    int error = xv6_inode_addr(check, dir, 0, &blockno, false);
+    if (error || blockno == 0) {
+        return error ? error : -EIO;
+    }
+    struct bufptr bp(check->bread(check->privat, blockno), check);
+    if (bp.buf_ == nullptr) { return -EIO; }
+    struct dirent *deptr = (struct dirent *) bp.data();
+    __builtin_memcpy(&deptr[XV6_HDIR_SLOT], head, sizeof(*head));
+    return check->bflush(check->privat, bp.buf_);
+}
+
+/*
+ * Split the bucket at head->split: entries whose hash selects the new
+ * bucket (1 << level) + split move to a newly allocated block. Without
+ * `move' the new bucket starts empty and the entries that belong there
+ * stay put, so the header is marked XV6_HDIR_SPILL instead.
+ * @return the new bucket; -ERR on error, -ENOSPC if the table is full.
+ */
+static int xv6_hdir_split(struct checker *check, struct xv6_inode_ctx *dir,
+            struct xv6_hdir *head, bool move) {
+    const uint nents = BSIZE / sizeof(struct dirent);
+    const uint level = head->level;
+    const uint split = __le16_to_cpu(head->split);
+    const uint nbucket = (1u << level) + split;
+    if (1 + nbucket >= MAXFILE) {
+        return -ENOSPC;
+    }
+
+    uint oldno, newno;
+    int error = xv6_inode_addr(check, dir, 1 + split, &oldno, false);
+    if (error || oldno == 0) {
+        return error ? error : -EIO;
+    }
+    /* Blocks from balloc are zeroed, i.e. a bucket without entries. */
+    error = xv6_inode_addr(check, dir, 1 + nbucket, &newno, true);
+    if (error) {
+        return error;
+    }
+    dir->size = (2 + nbucket) * BSIZE;
+    dir->dirty = true;
+
+    if (move) {
+        struct bufptr oldbp(check->bread(check->privat, oldno), check);
+        struct bufptr newbp(check->bread(check->privat, newno), check);
+        if (oldbp.buf_ == nullptr || newbp.buf_ == nullptr) { return -EIO; }
+        struct dirent *olds = (struct dirent *) oldbp.data();
+        struct dirent *news = (struct dirent *) newbp.data();
+        const uint seed = __le32_to_cpu(head->seed);
+        uint n = 0;
+        for (uint k = 0; k < nents; k++) {
+            if (olds[k].inum == 0) {
+                continue;
             }
-            if (flush) {
-                error = check->bflush(check->privat, debuf.buf_);
+            struct xv6_dname dn;
+            xv6_dname_from_dirent(&dn, &olds[k]);
+            uint h = xv6_hdir_hash((const char *) &dn, seed);
+            if ((h & ((2u << level) - 1)) != split) {
+                news[n++] = olds[k];
+                __builtin_memset(&olds[k], 0, sizeof(olds[k]));
             }
         }
+        /* Write the new bucket first, so that no entry is ever lost. */
+        if ((error = check->bflush(check->privat, newbp.buf_)) != 0 ||
+            (error = check->bflush(check->privat, oldbp.buf_)) != 0) {
+            return error;
+        }
+    } else {
+        head->flags |= XV6_HDIR_SPILL;
+    }
 
-        if (!act.cont || error) { break; }
-        i++;
-        size -= (lim - off);
-        off = 0;
-        if (!size) { break;}
+    if (split + 1 == (1u << level)) {
+        head->level = level + 1;
+        head->split = 0;
+    } else {
+        head->split = __cpu_to_le16(split + 1);
     }
+    error = xv6_hdir_sync_head(check, dir, head);
+    dir->dirty = true; /* inode_addr above cleared it. */
+    return error ? error : (int) nbucket;
+}
 
-    if (!error && act.cont && act.dir_ext) {
-        /* operate on one more dentry. possibly used by insert. */
-        size = dir->size;
-        size /= sizeof(struct dirent);
-        error = xv6_inode_addr(check, dir, size / nents, &blockno, alloc);
-        if (error) { return error; }
-        struct bufptr debuf (check->bread(check->privat, blockno), check);
-        if (debuf.buf_ == nullptr) { return -EIO; }
-        struct dirent *deptr = (struct dirent *) debuf.data();
-        deptr += size % nents;
-        act = callback(size, deptr, ctx);
-        if (act.dir_dirty) {
-            /* The insert method wants to extend inode. */
-            dir->dirty = true;
-            dir->size += sizeof(struct dirent);
+/*
+ * Put `de' in the first free slot of directory block `blk'.
+ * @return 1 if it went in, 0 if the block is full; -ERR on error.
+ */
+static int xv6_hdir_put(struct checker *check, struct xv6_inode_ctx *dir,
+            uint blk, const struct dirent *de, uint *dnum) {
+    const uint nents = BSIZE / sizeof(struct dirent);
+    uint blockno;
+    int error = xv6_inode_addr(check, dir, blk, &blockno, false);
+    if (error || blockno == 0) {
+        return error ? error : -EIO;
+    }
+    struct bufptr bp(check->bread(check->privat, blockno), check);
+    if (bp.buf_ == nullptr) { return -EIO; }
+    struct dirent *deptr = (struct dirent *) bp.data();
+    /* Block 0 starts with ., .. and the header. */
+    uint k = blk == 0 ? XV6_HDIR_SLOT + 1 : 0;
+    while (k < nents && deptr[k].inum != 0) {
+        k++;
+    }
+    if (k == nents) {
+        return 0;
+    }
+    deptr[k] = *de;
+    *dnum = blk * nents + k;
+    error = check->bflush(check->privat, bp.buf_);
+    return error ? error : 1;
+}
+
+int xv6_hdir_insert(struct checker *check, struct xv6_inode_ctx *dir,
+            const struct dirent *de, uint *dnum, bool move) {
+    struct xv6_hdir head;
+    bool dirty = dir->dirty;
+    int error = xv6_hdir_head(check, dir, &head);
+    if (error <= 0) {
+        return error ? error : -EINVAL;
+    }
+
+    struct xv6_dname dn;
+    xv6_dname_from_dirent(&dn, de);
+    const uint h = xv6_hdir_hash((const char *) &dn, __le32_to_cpu(head.seed));
+    uint bucket = xv6_hdir_bucket(head.level, __le16_to_cpu(head.split), h);
+    error = xv6_hdir_put(check, dir, 1 + bucket, de, dnum);
+    if (error == 0) {
+        /* The bucket is full: grow the table by one bucket, no more. */
+        const int nb = xv6_hdir_split(check, dir, &head, move);
+        dirty |= dir->dirty;
+        error = nb == -ENOSPC ? 0 : xv6_min(nb, 0);
+        if (!error) {
+            bucket = xv6_hdir_bucket(head.level, __le16_to_cpu(head.split), h);
+            error = xv6_hdir_put(check, dir, 1 + bucket, de, dnum);
         }
-        if (act.de_dirty) {
-            error = check->bflush(check->privat, debuf.buf_);
+    }
+    if (error == 0 && !(head.flags & XV6_HDIR_SPILL)) {
+        /* Flag first: a spilled entry must never be out of reach. */
+        head.flags |= XV6_HDIR_SPILL;
+        error = xv6_hdir_sync_head(check, dir, &head);
+    }
+    if (error == 0) {
+        /* Still full: take any free slot, newest block (a new bucket) first. */
+        const uint nblocks = dir->size / BSIZE;
+        for (uint blk = nblocks; error == 0 && blk-- > 0; ) {
+            error = xv6_hdir_put(check, dir, blk, de, dnum);
+        }
+        if (error == 0) {
+            error = -ENOSPC;
         }
     }
+    dir->dirty = dirty;
+    return xv6_min(error, 0);
+}
 
-    return error;
+int xv6_hdir_convert(struct checker *check, struct xv6_inode_ctx *dir,
+            uint seed) {
+    const uint nents = BSIZE / sizeof(struct dirent);
+    if (dir->size != BSIZE) {
+        return 0;
+    }
+    uint oldno, newno;
+    int error = xv6_inode_addr(check, dir, 0, &oldno, false);
+    if (error || oldno == 0) {
+        return error;
+    }
+    struct bufptr oldbp(check->bread(check->privat, oldno), check);
+    if (oldbp.buf_ == nullptr) { return -EIO; }
+    struct dirent *olds = (struct dirent *) oldbp.data();
+    for (uint k = 0; k < nents; k++) {
+        if (olds[k].inum == 0) {
+            /* Still has room; stay linear. */
+            return 0;
+        }
+    }
+
+    /* Move everything but . and .. to bucket 0. */
+    error = xv6_inode_addr(check, dir, 1, &newno, true);
+    if (error) {
+        return error;
+    }
+    struct bufptr newbp(check->bread(check->privat, newno), check);
+    if (newbp.buf_ == nullptr) { return -EIO; }
+    struct dirent *news = (struct dirent *) newbp.data();
+    for (uint k = XV6_HDIR_SLOT; k < nents; k++) {
+        news[k - XV6_HDIR_SLOT] = olds[k];
+    }
+    if ((error = check->bflush(check->privat, newbp.buf_)) != 0) {
+        return error;
+    }
+
+    __builtin_memset(&olds[XV6_HDIR_SLOT], 0, 
+                (nents - XV6_HDIR_SLOT) * sizeof(struct dirent));
+    struct xv6_hdir *head = (struct xv6_hdir *) &olds[XV6_HDIR_SLOT];
+    head->magic = XV6_HDIR_MAGIC;
+    head->seed = __cpu_to_le32(seed);
+    if ((error = check->bflush(check->privat, oldbp.buf_)) != 0) {
+        return error;
+    }
+    dir->size = 2 * BSIZE;
+    dir->dirty = true;
+    return 1;
 }
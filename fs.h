@@ -34,10 +34,15 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint features;     // XV6_FEATURE_* flags; zero on stock xv6 images
 } __attribute__((packed));
 
 #define FSMAGIC 0x10203040
 
+// Optional features, set in superblock.features.
+#define XV6_FEATURE_HDIR 0x1   // hashed directories (see struct xv6_hdir)
+#define XV6_FEATURE_ZFILE 0x2  // compressed regular files (see struct xv6_zhdr)
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
@@ -80,6 +85,101 @@ struct dirent {
   char name[DIRSIZ] __attribute__((nonstring));
 } __attribute__((packed));
 
+// Hashed directory layout (XV6_FEATURE_HDIR), a linear-hashing table:
+// block 0 holds ".", ".." and this header in dirent slot XV6_HDIR_SLOT,
+// block 1 + b holds the entries of bucket b. There are
+// (1 << level) + split buckets; a name with hash h lives in bucket
+// h mod 2^level, or h mod 2^(level+1) if that is below split.
+// h is xv6_hdir_hash keyed with the directory's random seed, so the
+// bucket of a name cannot be known without reading the header.
+//
+// An insert splits at most one bucket. If the name's bucket is still
+// full, or the directory is open and entries may not move, the entry
+// goes to any free slot (the rest of block 0 included) and the header
+// gets XV6_HDIR_SPILL: from then on a lookup that misses its bucket
+// scans the whole directory, as in a linear one.
+//
+// The header's inum and name[0] are zero and buckets are ordinary
+// dirent arrays, so a linear reader still sees a valid directory.
+#define XV6_HDIR_SLOT 2
+#define XV6_HDIR_MAGIC 0x48
+#define XV6_HDIR_SPILL 0x1   // some entries are outside their bucket
+struct xv6_hdir {
+  ushort inum;      // always 0
+  uchar name0;      // always 0
+  uchar magic;      // XV6_HDIR_MAGIC
+  uchar level;
+  uchar flags;      // XV6_HDIR_*
+  ushort split;     // next bucket to split
+  uint seed;        // hash key; 0 is the unkeyed hash of old images
+  uint reserved;
+} __attribute__((packed));
+
+// Compressed regular file layout (XV6_FEATURE_ZFILE): a T_FILE whose
+// major is XV6_ZALG_LZ4 is cut into clusters of 1 << shift blocks,
+// where shift is minor, or XV6_ZSHIFT_OLD if minor is 0 (images made
+// before minor was used). Bigger clusters compress better and cost
+// more to read at random. Logical block numbers are kept, so
+// cluster c owns addrs slots c << shift onwards. Let n be the number
+// of blocks of the cluster below size:
+//  - slot 0 is zero: the cluster is a hole;
+//  - slot n - 1 is set: the n blocks hold the data as is;
+//  - otherwise the leading slots hold this header followed by clen
+//    bytes of an LZ4 block that expands to the cluster's bytes, and
+//    the rest of the slots are zero.
+// Such files are written by mkxv6 -z or XV6_IOC_ZCOMPRESS. The kernel
+// expands a file back to a plain one when it is opened for writing.
+#define XV6_ZSHIFT_OLD 2
+#define XV6_ZSHIFT_DEFAULT 4  // what mkxv6 -z and the ioctl pick
+#define XV6_ZSHIFT_MIN 2
+#define XV6_ZSHIFT_MAX 6    // 64 KiB, the reach of an LZ4 match
+#define XV6_ZALG_LZ4 1
+struct xv6_zhdr {
+  uint clen;        // bytes of compressed data after the header
+} __attribute__((packed));
+
+// ioctl on a directory: pack its live entries to the front and free
+// the trailing blocks. Fails with EBUSY if anyone else has the directory
+// open, since entries move; the caller's own handle keeps its place.
+#define XV6_IOC_COMPACT _IO('x', 1)
+
+// ioctl on a regular file: compress it in place with clusters of
+// 1 << arg blocks (0 picks XV6_ZSHIFT_DEFAULT). Fails with ETXTBSY if
+// the file is open for writing, since writers expect plain blocks.
+#define XV6_IOC_ZCOMPRESS _IO('x', 2)
+
+// On-disk name hash of hashed directories: FNV-1a over the name, from
+// a seeded basis, then a seeded murmur3 finalizer so that every bit of
+// the bucket depends on the whole state. Seed 0 is plain FNV-1a.
+static inline uint
+xv6_hdir_hash(const char *name, uint seed)
+{
+  uint h = 2166136261u ^ seed;
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  if(seed){
+    h ^= seed;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+  }
+  return h;
+}
+
+// Bucket of hash h in a table with 2^level + split buckets.
+static inline uint
+xv6_hdir_bucket(uint level, uint split, uint h)
+{
+  uint b = h & ((1u << level) - 1);
+  if(b < split)
+    b = h & ((2u << level) - 1);
+  return b;
+}
+
 #ifdef __cplusplus
 }
 #endif /* C++ */
@@ -6,6 +6,7 @@
 #include <linux/vfs.h>
 
 #include "check.h"
+#include "xv6c++.h"
 
 /*
  * Xv6 filesystem info struct are defined here.
@@ -38,17 +39,115 @@ struct xv6_fs_info {
     uint bmapstart;    // Block number of first free map block
     uint ninode_blocks; // Number of inode blocks
     uint nbmap_blocks;  // Number of bitmap blocks
+    uint features;      // XV6_FEATURE_* flags of the super block
+    uchar *itypes;      // T_* of each inode for readdir, NULL if unknown.
     struct inode *root_dir;
     struct xv6_mount_options options;
     u64 balloc_hint; /* block allocation hint */
+    bool bmap_dirty; /* bitmap blocks not yet written, under balloc_lock */
     struct rb_root inode_tree; /* tree of active inodes */
     struct mutex itree_lock; /* lock for inode_tree */
     struct checker check; /* A generic fs context checker. */
 };
 
+/*
+ * In-memory name index of a large directory, see dir.c.
+ * Maps a name to its dirent number and inode number.
+ */
+struct xv6_dindex_ent {
+    struct hlist_node node;
+    struct xv6_dname name;
+    uint hash;
+    uint dnum;
+    uint inum;
+};
+
+/* Only directories larger than this get an index. */
+#define XV6_DINDEX_MIN_SIZE (2 * BSIZE)
+#define XV6_DINDEX_MIN_BUCKETS 64
+
+struct xv6_dindex {
+    struct hlist_head *buckets; /* power-of-two sized */
+    uint nbuckets;
+    uint count;                 /* number of entries */
+    bool referenced;            /* used since last shrinker pass */
+    struct list_head lru;       /* on the global index list */
+    struct xv6_inode_info *owner;
+};
+
+/* Free dirent slots of a directory, see dir.c */
+struct xv6_dfree {
+    uint *slots;    /* stack of known free dirent numbers */
+    uint count;
+    uint cap;
+    bool complete;  /* no free slot exists outside `slots' */
+};
+
+/*
+ * Blocks a file dropped, still set in the bitmap until its inode is
+ * written without them; see xv6_bfree_later. Under balloc_lock.
+ */
+struct xv6_bpend {
+    uint *blocks;
+    uint count;
+    uint cap;
+};
+
+/* The cluster of a compressed file expanded last, see xv6_zfill_folio. */
+struct xv6_zbuf {
+    char *buf;                  /* BSIZE << zshift bytes */
+    uint c;
+    bool valid;
+};
+
+/*
+ * A large directory is compacted after an erase once fewer than
+ * 1 / XV6_DCOMPACT_RATIO of its slots are live.
+ */
+#define XV6_DCOMPACT_MIN_SIZE (2 * BSIZE)
+#define XV6_DCOMPACT_RATIO 4
+
+/*
+ * Sequential lookups in a directory read ahead the inode blocks of
+ * the next XV6_IRA_DIRENTS entries, see xv6_dir_lookup_ra.
+ */
+#define XV6_IRA_DIRENTS 64
+
+/* Layout of a directory, cached in xv6_inode_info::dirfmt */
+enum {
+    XV6_DIRFMT_UNKNOWN = 0,
+    XV6_DIRFMT_LINEAR,
+    XV6_DIRFMT_HASHED, /* struct xv6_hdir */
+};
+
+/*
+ * A byte range [start, end] of a file being written, while i_rwsem is
+ * only held shared; see xv6_range_lock.
+ */
+struct xv6_range {
+    struct list_head node;
+    loff_t start;
+    loff_t end;
+};
+
 /* Used by struct inode::i_private. */
 struct xv6_inode_info {
     uint addrs[NDIRECT + 1];
+    struct mutex dir_lock;      /* protects dindex and dfree */
+    struct mutex map_lock;      /* serializes block allocation of a file */
+    spinlock_t range_lock;      /* protects ranges */
+    struct list_head ranges;    /* struct xv6_range being written */
+    wait_queue_head_t range_wait; /* for a range to be unlocked */
+    struct xv6_dindex *dindex;  /* name index, NULL if not built */
+    struct xv6_dfree dfree;
+    struct xv6_bpend bpend;     /* frees waiting for the inode write */
+    uchar dirfmt;               /* XV6_DIRFMT_* */
+    uchar zalg;                 /* XV6_ZALG_* of a compressed file, or 0 */
+    uchar zshift;               /* log2 blocks a cluster, if zalg */
+    atomic_t nopen;             /* open handles of a directory */
+    uint ra_prev;               /* dnum of the last lookup (a hint) */
+    uint ra_end;                /* inodes read ahead up to this dnum */
+    bool ra_seq;                /* the last lookups walked in order */
 };
 
 struct xv6_inode {
@@ -10,6 +10,8 @@
 #include <linux/mpage.h>
 #include <linux/rbtree.h>
 #include <linux/pagemap.h>
+#include <linux/random.h>
+#include <linux/shrinker.h>
 #include <linux/slab.h>
 #include <linux/uidgid.h>
 #include <linux/vfs.h>
@@ -26,8 +28,19 @@
 EXPORT_SYMBOL_GPL(xv6_docheck);
 EXPORT_SYMBOL_GPL(xv6_dir_iterate);
 EXPORT_SYMBOL_GPL(xv6_inode_addr);
+EXPORT_SYMBOL_GPL(xv6_inode_next);
+EXPORT_SYMBOL_GPL(xv6_inode_map);
+EXPORT_SYMBOL_GPL(xv6_hdir_head);
+EXPORT_SYMBOL_GPL(xv6_hdir_find);
+EXPORT_SYMBOL_GPL(xv6_hdir_insert);
+EXPORT_SYMBOL_GPL(xv6_hdir_convert);
+EXPORT_SYMBOL_GPL(xv6_dblock_find);
+EXPORT_SYMBOL_GPL(xv6_dir_find);
+EXPORT_SYMBOL_GPL(xv6_dir_empty);
 
 static struct kmem_cache *xv6_inode_cachep;
+static struct kmem_cache *xv6_dindex_cachep;
+static struct shrinker *xv6_dindex_shrinker;
 
 static const struct fs_context_operations xv6fs_context_ops = {
     .parse_param = xv6_parse_param,
@@ -76,10 +89,19 @@ static void checker_brelse(void *buffer) {
 
 static int checker_bflush(void *privat, void *buf) {
     struct buffer_head *bh = buf;
+    /* It may point at blocks just allocated. */
+    int error = xv6_bmap_sync(privat);
+    if (error) {
+        return error;
+    }
     mark_buffer_dirty(bh);
     return sync_dirty_buffer(bh);
 }
 
+static int checker_bfree(void *privat, uint block) {
+    return xv6_bfree(privat, block);
+}
+
 static void xv6_init_once(void *pt) {
     struct xv6_inode *xi = pt;
     inode_init_once(&xi->inode);
@@ -95,11 +117,30 @@ static int __init xv6fs_init(void) {
 				xv6_init_once);
 	if (xv6_inode_cachep == NULL)
 		return -ENOMEM;
+	xv6_dindex_cachep = kmem_cache_create("xv6_dindex_cache",
+				sizeof(struct xv6_dindex_ent),
+				0, SLAB_RECLAIM_ACCOUNT, NULL);
+	if (xv6_dindex_cachep == NULL)
+		goto out_inode_cache;
+	xv6_dindex_shrinker = shrinker_alloc(0, "xv6-dindex");
+	if (xv6_dindex_shrinker == NULL)
+		goto out_dindex_cache;
+	xv6_dindex_shrinker->count_objects = xv6_dindex_count;
+	xv6_dindex_shrinker->scan_objects = xv6_dindex_scan;
+	shrinker_register(xv6_dindex_shrinker);
     return register_filesystem(&xv6fs_type);
+
+out_dindex_cache:
+	kmem_cache_destroy(xv6_dindex_cachep);
+out_inode_cache:
+	kmem_cache_destroy(xv6_inode_cachep);
+	return -ENOMEM;
 }
 static void __exit xv6fs_exit(void) {
-	kmem_cache_destroy(xv6_inode_cachep);
 	unregister_filesystem(&xv6fs_type);
+	shrinker_free(xv6_dindex_shrinker);
+	kmem_cache_destroy(xv6_dindex_cachep);
+	kmem_cache_destroy(xv6_inode_cachep);
 }
 module_init(xv6fs_init);
 module_exit(xv6fs_exit);
@@ -1,5 +1,6 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <linux/fs_context.h>
 #include <linux/iversion.h>
@@ -17,6 +18,10 @@ static int xv6_ialloc(uint *inum, struct super_block *sb,
     *inum = 0;
     const struct xv6_fs_info *fsinfo = (const void *) sb->s_fs_info;
     uint node = 2 /* skip null and root. */;
+    /* The blocks dino points at must be marked used on disk first. */
+    if (dino && xv6_bmap_sync(sb)) {
+        return -EIO;
+    }
     const uint block_inodes = BSIZE / sizeof(*dino);
     const uint blockend = fsinfo->bmapstart;
     uint block = fsinfo->inodestart;
@@ -45,6 +50,9 @@ static int xv6_ialloc(uint *inum, struct super_block *sb,
                     break;
                 }
                 *inum = node;
+                if (dino) {
+                    xv6_itypes_set(sb, node, __le16_to_cpu(dino->type));
+                }
                 break;
             }
         }
@@ -82,6 +90,7 @@ static int xv6_ifree(struct super_block *sb, uint inum) {
     mark_buffer_dirty(bh);
     error = sync_dirty_buffer(bh);
     brelse(bh); 
+    xv6_itypes_set(sb, inum, 0);
 
 ifree_fini:
     xv6_unlock_itable(sb);
@@ -92,7 +101,9 @@ static int xv6_hash(const struct dentry *dentry, struct qstr *s) {
     const unsigned char *xv6_name = s->name;
 
     if (*xv6_name != 0) {
-        s->hash = full_name_hash(dentry, xv6_name, DIRSIZ);
+        struct xv6_dname key;
+        xv6_dname_from_str(&key, (const char *) s->name, s->len);
+        s->hash = xv6_dname_hash(&key, (unsigned long) dentry);
     }
 
     /* Success */
@@ -101,23 +112,14 @@ static int xv6_hash(const struct dentry *dentry, struct qstr *s) {
 
 static int xv6_cmp(const struct dentry *dentry,
          unsigned int len, const char *str, const struct qstr *name) {
-    __attribute__((unused)) struct super_block *sb = 
-                dentry->d_sb; 
-    
-    int ret = 0;
-    unsigned char a, b;
-    const unsigned char *pa = name->name;
-    const unsigned char *pb = str;
-    for (int i = 0; i < DIRSIZ; i++) {
-        a = pa[i]; 
-        b = pb[i];
-        if (a != b || (!a)) {
-            ret = (int) a;
-            ret -= b;
-            break;
-        }
-    }
-    return ret;
+    /* Names in the dcache hold no NUL, so lengths differ iff names do. */
+    if (xv6_min(len, (uint) DIRSIZ) != xv6_min(name->len, (uint) DIRSIZ)) {
+        return 1;
+    }
+    struct xv6_dname a, b;
+    xv6_dname_from_str(&a, (const char *) name->name, name->len);
+    xv6_dname_from_str(&b, str, len);
+    return !xv6_dname_eq(&a, &b);
 }
 
 static struct dentry *xv6_lookup(struct inode *dir, struct dentry *dentry,
@@ -128,6 +130,9 @@ static struct dentry *xv6_lookup(struct inode *dir, struct dentry *dentry,
     uint dnum = 0;
     struct dirent de;
     int reason = xv6_find_inum(dir, dentry->d_name.name, &dnum, &de);
+    if (dnum && !reason) {
+        xv6_dir_lookup_ra(dir, dnum);
+    }
     if (!dnum) {
         /* Not found. Like vfat_lookup, should return null. */
         return NULL;
@@ -207,6 +212,7 @@ static int xv6_init_inode(struct inode *ino, const struct dinode *dino, uint inu
 
     ushort itype = __le16_to_cpu((ushort) dino->type);
     bool isdir = false;
+    uchar zalg = 0, zshift = 0;
     switch (itype) {
         case T_DIR: isdir = true;
             break;
@@ -225,6 +231,25 @@ static int xv6_init_inode(struct inode *ino, const struct dinode *dino, uint inu
     } else {
 		ino->i_generation |= 1;
         mode |= S_IFREG;
+        ino->i_mapping->a_ops = &xv6_aops;
+    }
+    if (itype == T_FILE && (fsinfo->features & XV6_FEATURE_ZFILE) &&
+                dino->major != 0) {
+        zalg = __le16_to_cpu((ushort) dino->major);
+        if (zalg != XV6_ZALG_LZ4) {
+            xv6_error("inode %lu: Unsupported compression %hu\n", ino->i_ino, 
+                        __le16_to_cpu((ushort) dino->major));
+            return -EINVAL;
+        }
+        zshift = __le16_to_cpu((ushort) dino->minor);
+        zshift = zshift ? zshift : XV6_ZSHIFT_OLD;
+        if (zshift < XV6_ZSHIFT_MIN || zshift > XV6_ZSHIFT_MAX) {
+            xv6_error("inode %lu: Bad compressed cluster shift %hu\n", 
+                        ino->i_ino, __le16_to_cpu((ushort) dino->minor));
+            return -EINVAL;
+        }
+        ino->i_fop = &xv6_zfile_ops;
+        ino->i_mapping->a_ops = &xv6_zaops;
     }
 
     /* For simplicity, set them to 1970-01-01. */
@@ -240,6 +265,20 @@ static int xv6_init_inode(struct inode *ino, const struct dinode *dino, uint inu
     for (int i = 0; i < NDIRECT + 1; i++) {
         addrs[i] = __le32_to_cpu(dino->addrs[i]);
     }
+    mutex_init(&i_info->dir_lock);
+    mutex_init(&i_info->map_lock);
+    spin_lock_init(&i_info->range_lock);
+    INIT_LIST_HEAD(&i_info->ranges);
+    init_waitqueue_head(&i_info->range_wait);
+    i_info->dindex = NULL;
+    memset(&i_info->dfree, 0, sizeof(i_info->dfree));
+    memset(&i_info->bpend, 0, sizeof(i_info->bpend));
+    i_info->dirfmt = XV6_DIRFMT_UNKNOWN;
+    i_info->zalg = zalg;
+    i_info->zshift = zshift;
+    atomic_set(&i_info->nopen, 0);
+    i_info->ra_prev = i_info->ra_end = 0;
+    i_info->ra_seq = false;
     ino->i_private = i_info;
     insert_inode_hash(ino);
 
@@ -258,7 +297,7 @@ static int xv6_getattr(struct mnt_idmap *idmap, const struct path *path,
     return 0;
 }
 
-static int xv6_sync_inode(struct inode *ino) {
+static int xv6_sync_dinode(struct inode *ino, const uint *addrs) {
     struct super_block *xv6_sb = ino->i_sb;
     if (xv6_sb->s_flags & SB_RDONLY) {
         return 0;
@@ -267,6 +306,10 @@ static int xv6_sync_inode(struct inode *ino) {
     const struct xv6_fs_info *fsinfo = xv6_sb->s_fs_info;
     const uint inum = ino->i_ino;
     xv6_assert(inum && "null inode found");
+    int error = xv6_bmap_sync(xv6_sb);
+    if (error) {
+        return error;
+    }
     uint block = fsinfo->inodestart + inum / IPB;
 
     struct buffer_head *bh = sb_bread(xv6_sb, block);
@@ -276,22 +319,39 @@ static int xv6_sync_inode(struct inode *ino) {
     struct dinode *dptr = (struct dinode *) bh->b_data;
     dptr += inum % IPB;
 
-    if (ino->i_private) {
-        uint *addrs = ((struct xv6_inode_info *) ino->i_private)->addrs;
+    if (addrs) {
         for (int i = 0; i < NDIRECT + 1; i++) {
             dptr->addrs[i] = __cpu_to_le32(addrs[i]);
         }
     } else {
         xv6_warn("inode %lu has no private data\n", ino->i_ino);
     }
+    const struct xv6_inode_info *ii = ino->i_private;
+    if (ii && (fsinfo->features & XV6_FEATURE_ZFILE) && 
+                dptr->type == (short) __cpu_to_le16(T_FILE)) {
+        /* Goes out with addrs: a file turns (un)compressed in one write. */
+        dptr->major = __cpu_to_le16(ii->zalg);
+        dptr->minor = __cpu_to_le16(ii->zalg ? ii->zshift : 0);
+    }
     dptr->size = __cpu_to_le32((uint) ino->i_size);
     dptr->nlink = __cpu_to_le16((ushort) ino->i_nlink);
     mark_buffer_dirty(bh);
-    int error = sync_dirty_buffer(bh);
+    error = sync_dirty_buffer(bh);
     brelse(bh);
     return error;
 }
 
+static int xv6_sync_inode(struct inode *ino) {
+    struct xv6_inode_info *ii = ino->i_private;
+    /* Blocks dropped before addrs is copied out may go once it is written. */
+    const uint npend = xv6_bfree_waiting(ino);
+    int error = xv6_sync_dinode(ino, ii ? ii->addrs : NULL);
+    if (!error && !(ino->i_sb->s_flags & SB_RDONLY)) {
+        xv6_bfree_release(ino, npend);
+    }
+    return error;
+}
+
 static void xv6_evict_inode(struct inode *ino) {
    /*
     * https://elixir.bootlin.com/linux/v6.17.4/source/fs/autofs/inode.c#L105
@@ -299,65 +359,15 @@ static void xv6_evict_inode(struct inode *ino) {
     xv6_debug("evicting inode %lu", ino->i_ino);
     truncate_inode_pages_final(&ino->i_data);
     clear_inode(ino);
+    if (ino->i_private) {
+        xv6_dindex_drop(ino->i_private);
+        xv6_dfree_reset(ino->i_private);
+        xv6_bfree_forget(ino);
+    }
     kfree(ino->i_private);
     ino->i_private = NULL;
 }
 
-static int xv6_inode_block(struct inode *ino, uint i,
-            struct buffer_head **bhptr) {
-    struct super_block *sb = ino->i_sb;
-    *bhptr = NULL;
-    struct xv6_fs_info *fsinfo = sb->s_fs_info;
-    struct dinode di;
-    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(ino);
-    uint blockno = 0;
-    int error = xv6_init_ictx(&ictx, ino, &di);
-    if (error) {
-        return error;
-    }
-
-    error = xv6_inode_addr(&fsinfo->check, &ictx, i, &blockno, false);
-    if (error) {
-        return error;
-    }
-    if (blockno) {
-        *bhptr = sb_bread(sb, blockno);
-        error = *bhptr == NULL ? -EIO : 0;
-    }
-    xv6_assert(!ictx.dirty && "inode_addr should not mutate inode");
-    return error;
-}
-
-static int xv6_inode_wblock(struct inode *ino, uint i,
-            struct buffer_head **bhptr) {
-    struct super_block *sb = ino->i_sb;
-    *bhptr = NULL;
-    struct xv6_fs_info *fsinfo = sb->s_fs_info;
-    struct dinode di;
-    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(ino);
-    uint blockno = 0;
-    int error = xv6_init_ictx(&ictx, ino, &di);
-    if (unlikely(error)) {
-        return error;
-    }
-
-    error = xv6_inode_addr(&fsinfo->check, &ictx, i, &blockno, true);
-    if (error) {
-        return error;
-    }
-    if (likely(blockno)) {
-        *bhptr = sb_bread(sb, blockno);
-        error = *bhptr == NULL ? -EIO : 0;
-    } else {
-        error = -ENOSPC;
-    }
-    
-    if (!error) {
-        error = xv6_ictx_dirty(ino, &ictx);
-    }
-    return error;
-}
-
 static int xv6_create(struct mnt_idmap *idmap, struct inode *dir,
             struct dentry *dentry, umode_t mode, bool extc) {
     const char *name = dentry->d_name.name;
@@ -438,11 +448,74 @@ static int xv6_setattr (struct mnt_idmap *a1, struct dentry *a2,
     return 0;
 }
 
+static int xv6_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+            u64 start, u64 len) {
+    struct xv6_fs_info *fsinfo = inode->i_sb->s_fs_info;
+    struct xv6_inode_ctx ictx = xv6_inode_ctx_init(inode);
+    struct dinode di;
+    int error = fiemap_prep(inode, fieinfo, start, &len, 0);
+    if (error) {
+        return error;
+    }
+
+    /* Extents of a compressed file hold fewer bytes than they map. */
+    const struct xv6_inode_info *ii = inode->i_private;
+    const u32 encoded = ii && ii->zalg ? FIEMAP_EXTENT_ENCODED : 0;
+    xv6_ilock_shared(inode);
+    const uint nblocks = xv6_min(DIV_ROUND_UP((u64) i_size_read(inode), BSIZE),
+                (u64) MAXFILE);
+    const uint first = xv6_min(start / BSIZE, (u64) nblocks);
+    const uint last = xv6_min(DIV_ROUND_UP(start + len, BSIZE), (u64) nblocks);
+    error = xv6_init_ictx(&ictx, inode, &di);
+
+    /* The extent being merged: [logical, logical + elen) at phys. */
+    u64 logical = 0, phys = 0, elen = 0;
+    struct xv6_run runs[16];
+    uint i = first;
+    while (!error && i < last) {
+        uint nrun = ARRAY_SIZE(runs);
+        error = xv6_inode_map(&fsinfo->check, &ictx, i, last - i, 
+                    runs, &nrun, false);
+        if (error || nrun == 0) {
+            break;
+        }
+        for (uint k = 0; !error && k < nrun; k++) {
+            const struct xv6_run *r = &runs[k];
+            i = r->lblk + r->len;
+            if (r->pblk == 0) {
+                continue;
+            }
+            if (elen && logical + elen == (u64) r->lblk * BSIZE &&
+                        phys + elen == (u64) r->pblk * BSIZE) {
+                /* Runs from two batches can still be contiguous. */
+                elen += (u64) r->len * BSIZE;
+                continue;
+            }
+            if (elen) {
+                error = fiemap_fill_next_extent(fieinfo, logical, phys, elen,
+                            encoded);
+            }
+            logical = (u64) r->lblk * BSIZE;
+            phys = (u64) r->pblk * BSIZE;
+            elen = (u64) r->len * BSIZE;
+        }
+    }
+    if (!error && elen) {
+        u32 flags = encoded | (last == nblocks ? FIEMAP_EXTENT_LAST : 0);
+        error = fiemap_fill_next_extent(fieinfo, logical, phys, elen, flags);
+    }
+    xv6_iunlock_shared(inode);
+    /* 1 means the user's extent array is full. */
+    return error == 1 ? 0 : error;
+}
+
 static int xv6_inode_clear(struct inode *inode) {
     int error= 0;
     struct super_block *sb = inode->i_sb;
     struct dinode dino;
     uint *addrs;
+    /* Cached pages must not be written back to the freed blocks. */
+    truncate_inode_pages(&inode->i_data, 0);
     if (unlikely(inode->i_private == NULL)) {
         /* warn potential ENOMEM */
         error = xv6_dget(inode, &dino);
@@ -456,42 +529,123 @@ static int xv6_inode_clear(struct inode *inode) {
         addrs = tmp->addrs;
     }
 
+    /* Read the indirect block first, so a failure changes nothing. */
+    struct buffer_head *bh = NULL;
+    if (addrs[NDIRECT]) {
+        bh = sb_bread(sb, addrs[NDIRECT]);
+        if (bh == NULL) {
+            return -EIO;
+        }
+    }
+
+    /* The blocks are freed once the inode no longer points at them. */
+    uint old[NDIRECT + 1];
+    memcpy(old, addrs, sizeof(old));
+    memset(addrs, 0, sizeof(old));
+    inode->i_size = 0;
+    mark_inode_dirty(inode);
+    error = inode->i_private ? xv6_sync_inode(inode) : 
+                xv6_sync_dinode(inode, addrs);
+    if (error) {
+        /* The blocks stay allocated; a leak is safe, a reuse is not. */
+        brelse(bh);
+        return error;
+    }
+
     for (int i = 0; i < NDIRECT; i++) {
-        if (addrs[i] != 0) {
-            (void) xv6_bfree(sb, addrs[i]);
-            addrs[i] = 0;
+        if (old[i] != 0) {
+            (void) xv6_bfree(sb, old[i]);
         }
     }
+    if (bh) {
+        uint *iaddrs = (uint *) bh->b_data;
+        for (int i = 0; i < NINDIRECT; i++) {
+            if (iaddrs[i] != 0) {
+                (void) xv6_bfree(sb, __le32_to_cpu(iaddrs[i]));
+            }
+        }
+        brelse(bh);
+        (void) xv6_bfree(sb, old[NDIRECT]);
+    }
+    return 0;
+}
+
+static int xv6_inode_free_from(struct inode *inode, uint first) {
+    struct super_block *sb = inode->i_sb;
+    struct xv6_inode_info *ii = inode->i_private;
+    uint *addrs = ii->addrs;
+    int error = 0;
 
-    uint iaddr = addrs[NDIRECT];
+    /* Read the indirect block first, so a failure frees nothing. */
+    const uint iaddr = addrs[NDIRECT];
+    const uint from = first > NDIRECT ? first - NDIRECT : 0;
+    struct buffer_head *bh = NULL;
+    uint n = 0, nind = 0;
     if (iaddr) {
-        struct buffer_head *bh = sb_bread(sb, iaddr);
+        bh = sb_bread(sb, iaddr);
         if (bh == NULL) {
             return -EIO;
         }
+        const uint *iaddrs = (const uint *) bh->b_data;
+        for (uint i = from; i < NINDIRECT; i++) {
+            nind += iaddrs[i] != 0;
+        }
+        n = nind + (from == 0);
+    }
+    for (uint i = first; i < NDIRECT; i++) {
+        n += addrs[i] != 0;
+    }
+    /* Blocks the indirect block drops wait here until it is written. */
+    uint *dropped = NULL;
+    if (from != 0 && nind != 0) {
+        dropped = kmalloc_array(nind, sizeof(uint), GFP_NOFS);
+        error = dropped ? 0 : -ENOMEM;
+    }
+    if (error || (error = xv6_bfree_reserve(inode, n)) != 0) {
+        kfree(dropped);
+        brelse(bh);
+        return error;
+    }
+
+    /* Out of addrs first, then queued until the inode is written. */
+    for (uint i = first; i < NDIRECT; i++) {
+        if (addrs[i] != 0) {
+            const uint block = addrs[i];
+            addrs[i] = 0;
+            xv6_bfree_later(inode, block);
+        }
+    }
+
+    if (bh && from == 0) {
+        /* Nothing reaches the indirect block once the inode is written. */
+        const uint *iaddrs = (const uint *) bh->b_data;
+        addrs[NDIRECT] = 0;
+        for (uint i = 0; i < NINDIRECT; i++) {
+            if (iaddrs[i] != 0) {
+                xv6_bfree_later(inode, __le32_to_cpu(iaddrs[i]));
+            }
+        }
+        brelse(bh);
+        xv6_bfree_later(inode, iaddr);
+    } else if (bh) {
         uint *iaddrs = (uint *) bh->b_data;
-        for (int i = 0; i < NINDIRECT; i++) {
+        uint k = 0;
+        for (uint i = from; i < NINDIRECT; i++) {
             if (iaddrs[i] != 0) {
-                (void) xv6_bfree(sb, __le32_to_cpu(iaddrs[i]));
+                dropped[k++] = __le32_to_cpu(iaddrs[i]);
+                iaddrs[i] = 0;
             }
         }
+        mark_buffer_dirty(bh);
+        error = sync_dirty_buffer(bh);
         brelse(bh);
-        (void) xv6_bfree(sb, iaddr);
+        /* If the write failed they may still be listed; leak them. */
+        for (uint i = 0; !error && i < k; i++) {
+            xv6_bfree_later(inode, dropped[i]);
+        }
+        kfree(dropped);
     }
-    addrs[NDIRECT] = 0;
-
-    inode->i_size = 0;
     mark_inode_dirty(inode);
-    if (unlikely(inode->i_private == NULL)) {
-        /* write this inode to disk. */
-        xv6_assert(offsetof(struct xv6_inode_info, addrs) == 0);
-        inode->i_private = addrs;
-        /* sync method depends on i_private to work properly. */
-        error = xv6_sync_inode(inode);
-        inode->i_private = NULL;
-    } else {
-        error = xv6_sync_inode(inode);
-    }
     return error;
 }
 
@@ -502,9 +656,7 @@ static inline int xv6_ictx_dirty(struct inode *inode,
         mark_inode_dirty(inode);
         inode->i_size = ictx->size;
         if (unlikely(inode->i_private == NULL)) {
-            inode->i_private = ictx->addrs;
-            error = xv6_sync_inode(inode);
-            inode->i_private = NULL;
+            error = xv6_sync_dinode(inode, ictx->addrs);
         }
     }
     return error;
@@ -523,6 +675,7 @@ static const struct inode_operations xv6_inode_ops = {
     .link = xv6_link,
     .unlink = xv6_unlink,
     .rename = xv6_rename,
+    .fiemap = xv6_fiemap,
 };
 
 /* comparison */
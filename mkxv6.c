@@ -12,6 +12,13 @@
 //! For each 'file' to be copied into disk image, we
 //! find that it is an directory, we also create a 
 //! directory in image, instead of a regular file.
+//!
+//! With -H (mkxv6 -H fs.img files...), the root directory
+//! is laid out as a hashed directory (see struct xv6_hdir),
+//! and the image gets the XV6_FEATURE_HDIR feature.
+//!
+//! With -z, regular files are stored LZ4-compressed (see struct
+//! xv6_zhdr), and the image gets the XV6_FEATURE_ZFILE feature.
 
 
 #include <stdbool.h>
@@ -71,6 +78,12 @@ static struct superblock sb;
 static char zeroes[BSIZE];
 static uint freeinode = 1;
 static uint freeblock;
+XV6_LOCAL(int) hashdir;  // -H: build a hashed root directory
+XV6_LOCAL(int) zfile;    // -z: compress regular files
+XV6_LOCAL(uint) zshift = XV6_ZSHIFT_DEFAULT;  // -c: log2 blocks a cluster
+XV6_LOCAL(uint) zlogical, zstored;  // -z: data blocks before and after
+static struct dirent rootents[NINODES];
+static uint nrootents;
 
 
 XV6_LOCAL(void) balloc(int);
@@ -80,7 +93,11 @@ XV6_LOCAL(void) rinode(uint inum, struct dinode *ip);
 XV6_LOCAL(void) rsect(uint sec, void *buf);
 XV6_LOCAL(uint) ialloc(ushort type);
 XV6_LOCAL(void) iappend(uint inum, void *p, int n);
+XV6_LOCAL(uint) ibmap(struct dinode *din, uint fbn);
+XV6_LOCAL(void) zappend(uint inum, int fd);
 XV6_LOCAL(void) die(const char *);
+XV6_LOCAL(void) rootappend(uint rootino, struct dirent *de);
+XV6_LOCAL(void) hashroot(uint rootino);
 
 // convert to riscv byte order
 static inline ushort
@@ -109,7 +126,7 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, cc, fd, argi;
   uint rootino, inum, off;
   struct dirent de;
   char buf[BSIZE];
@@ -118,17 +135,32 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  for(argi = 1; argi < argc && argv[argi][0] == '-'; argi++){
+    if(strcmp(argv[argi], "-H") == 0)
+      hashdir = 1;
+    else if(strcmp(argv[argi], "-z") == 0)
+      zfile = 1;
+    else if(strcmp(argv[argi], "-c") == 0 && argi + 1 < argc){
+      zshift = atoi(argv[++argi]);
+      if(zshift < XV6_ZSHIFT_MIN || zshift > XV6_ZSHIFT_MAX){
+        fprintf(stderr, "mkfs: -c takes %d to %d\n", XV6_ZSHIFT_MIN,
+                XV6_ZSHIFT_MAX);
+        exit(1);
+      }
+    } else
+      break;
+  }
+  if(argc < argi + 1 || argv[argi][0] == '-'){
+    fprintf(stderr, "Usage: mkfs [-H] [-z [-c shift]] fs.img files...\n");
     exit(1);
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
-  fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
+  fsfd = open(argv[argi], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
-    die(argv[1]);
+    die(argv[argi]);
 
   // 1 fs block = 1 disk sector
   nmeta = 1 + nlog + ninodeblocks + nbitmap;
@@ -142,6 +174,8 @@ main(int argc, char *argv[])
   sb.logstart = xint(1);
   sb.inodestart = xint(1+nlog);
   sb.bmapstart = xint(1+nlog+ninodeblocks);
+  sb.features = xint((hashdir ? XV6_FEATURE_HDIR : 0) |
+                     (zfile ? XV6_FEATURE_ZFILE : 0));
 
   printf("nmeta %d (super, log blocks %u, inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -168,7 +202,7 @@ main(int argc, char *argv[])
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
-  for(i = 2; i < argc; i++){
+  for(i = argi + 1; i < argc; i++){
     // get rid of "user/"
     char *shortname;
     if(strncmp(argv[i], "user/", 5) == 0)
@@ -208,6 +242,8 @@ main(int argc, char *argv[])
       de2.inum = xshort(rootino);
       strcpy(de2.name, "..");
       iappend(inum, &de2, sizeof(de2));
+    } else if(zfile){
+      zappend(inum, fd);
     } else {
 
       while((cc = read(fd, buf, sizeof(buf))) > 0)
@@ -217,17 +253,24 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    rootappend(rootino, &de);
   
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(zfile)
+    printf("zfile: %u data blocks stored in %u\n", zlogical, zstored);
+
+  if(hashdir){
+    hashroot(rootino);
+  } else {
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(freeblock);
 
@@ -318,7 +361,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -326,23 +368,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = ibmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -355,6 +381,220 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Disk block of file block fbn, allocated on first use.
+static uint
+ibmap(struct dinode *din, uint fbn)
+{
+  uint indirect[NINDIRECT];
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0){
+      din->addrs[fbn] = xint(freeblock++);
+    }
+    return xint(din->addrs[fbn]);
+  }
+  if(xint(din->addrs[NDIRECT]) == 0){
+    din->addrs[NDIRECT] = xint(freeblock++);
+  }
+  rsect(xint(din->addrs[NDIRECT]), (char*)indirect);
+  if(indirect[fbn - NDIRECT] == 0){
+    indirect[fbn - NDIRECT] = xint(freeblock++);
+    wsect(xint(din->addrs[NDIRECT]), (char*)indirect);
+  }
+  return xint(indirect[fbn - NDIRECT]);
+}
+
+// Emit one LZ4 sequence: nlit literals, then a match of mlen bytes
+// dist bytes back. The last sequence of a block has no match (mlen 0).
+static int
+lz4_emit(uchar **opp, uchar *end, const uchar *lit, uint nlit,
+         uint dist, uint mlen)
+{
+  uchar *op = *opp, *token;
+  uint k;
+
+  if((uint)(end - op) < 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1)
+    return 0;
+  token = op++;
+  *token = (nlit < 15 ? nlit : 15) << 4;
+  if(nlit >= 15){
+    for(k = nlit - 15; k >= 255; k -= 255)
+      *op++ = 255;
+    *op++ = k;
+  }
+  memmove(op, lit, nlit);
+  op += nlit;
+  if(mlen){
+    *op++ = dist;
+    *op++ = dist >> 8;
+    mlen -= 4;
+    *token |= mlen < 15 ? mlen : 15;
+    if(mlen >= 15){
+      for(k = mlen - 15; k >= 255; k -= 255)
+        *op++ = 255;
+      *op++ = k;
+    }
+  }
+  *opp = op;
+  return 1;
+}
+
+// Greedy LZ4 block compressor for one cluster (n <= 64K). Returns the
+// compressed length, or 0 if it does not fit in cap bytes.
+static uint
+lz4_compress(const char *xsrc, uint n, char *xdst, uint cap)
+{
+  const uchar *src = (const uchar*)xsrc;
+  uchar *dst = (uchar*)xdst, *op = dst;
+  int table[1 << 12];
+  uint ip = 0, anchor = 0, len, v, h;
+  int ref;
+
+  memset(table, 0xff, sizeof(table));
+  // A match may not start in the last 12 bytes, nor cover the last 5.
+  while(ip + 12 < n){
+    memmove(&v, src + ip, 4);
+    h = (v * 2654435761u) >> 20;
+    ref = table[h];
+    table[h] = ip;
+    if(ref < 0 || memcmp(src + ref, src + ip, 4) != 0){
+      ip++;
+      continue;
+    }
+    for(len = 4; ip + len < n - 5 && src[ref + len] == src[ip + len]; len++)
+      ;
+    if(!lz4_emit(&op, dst + cap, src + anchor, ip - anchor, ip - ref, len))
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+  if(!lz4_emit(&op, dst + cap, src + anchor, n - anchor, 0, 0))
+    return 0;
+  return op - dst;
+}
+
+// Copy fd into inode inum cluster by cluster, compressing each one
+// that saves at least a block (see struct xv6_zhdr).
+static void
+zappend(uint inum, int fd)
+{
+  const uint csize = BSIZE << zshift;
+  static char data[BSIZE << XV6_ZSHIFT_MAX], zbuf[BSIZE << XV6_ZSHIFT_MAX];
+  struct dinode din;
+  struct xv6_zhdr zh;
+  uint off, n, nblk, zblk, clen, i;
+  int cc;
+
+  rinode(inum, &din);
+  assert(xint(din.size) == 0);
+  din.major = xshort(XV6_ZALG_LZ4);
+  din.minor = xshort(zshift);
+  for(off = 0; ; off += csize){
+    for(n = 0; n < csize; n += cc){
+      if((cc = read(fd, data + n, csize - n)) < 0)
+        die("read");
+      if(cc == 0)
+        break;
+    }
+    if(n == 0)
+      break;
+    nblk = (n + BSIZE - 1) / BSIZE;
+    zlogical += nblk;
+    clen = lz4_compress(data, n, zbuf + sizeof(zh), csize - sizeof(zh));
+    zblk = (sizeof(zh) + clen + BSIZE - 1) / BSIZE;
+    if(clen == 0 || zblk >= nblk){
+      memset(data + n, 0, csize - n);
+      for(i = 0; i < nblk; i++)
+        wsect(ibmap(&din, off / BSIZE + i), data + i * BSIZE);
+      zstored += nblk;
+    } else {
+      zh.clen = xint(clen);
+      memmove(zbuf, &zh, sizeof(zh));
+      memset(zbuf + sizeof(zh) + clen, 0, zblk * BSIZE - sizeof(zh) - clen);
+      for(i = 0; i < zblk; i++)
+        wsect(ibmap(&din, off / BSIZE + i), zbuf + i * BSIZE);
+      zstored += zblk;
+    }
+    din.size = xint(off + n);
+  }
+  winode(inum, &din);
+}
+
+// Add an entry to the root directory. Hashed roots are
+// written out at the end by hashroot().
+static void
+rootappend(uint rootino, struct dirent *de)
+{
+  if(!hashdir){
+    iappend(rootino, de, sizeof(*de));
+    return;
+  }
+  assert(nrootents < NINODES);
+  rootents[nrootents++] = *de;
+}
+
+// Lay out the root as a hashed directory: "." and ".." are already
+// in block 0, so fill it up with the header, then append enough
+// buckets to keep each of them at most half full.
+static void
+hashroot(uint rootino)
+{
+  const uint nents = BSIZE / sizeof(struct dirent);
+  struct dirent blk[BSIZE / sizeof(struct dirent)];
+  struct xv6_hdir *head;
+  uint level, nbucket, b, i, k, seed;
+  int fd;
+
+  // A random hash key, so that nobody can pick names for one bucket.
+  if((fd = open("/dev/urandom", O_RDONLY)) < 0 ||
+     read(fd, &seed, sizeof(seed)) != sizeof(seed))
+    die("/dev/urandom");
+  close(fd);
+  if(seed == 0)
+    seed = 1;
+
+  // Start at half full; take a level more while any bucket overflows.
+  for(level = 0; (1u << level) * nents < 2 * nrootents; level++)
+    ;
+  for(;; level++){
+    nbucket = 1u << level;
+    if(1 + nbucket > MAXFILE){
+      fprintf(stderr, "mkfs: the root directory does not fit in %lu buckets\n",
+              (unsigned long)MAXFILE - 1);
+      exit(1);
+    }
+    for(b = 0; b < nbucket; b++){
+      k = 0;
+      for(i = 0; i < nrootents && k <= nents; i++)
+        k += xv6_hdir_bucket(level, 0, xv6_hdir_hash(rootents[i].name, seed)) == b;
+      if(k > nents)
+        break;
+    }
+    if(b == nbucket)
+      break;
+  }
+
+  bzero(blk, sizeof(blk));
+  head = (struct xv6_hdir*)&blk[XV6_HDIR_SLOT];
+  head->magic = XV6_HDIR_MAGIC;
+  head->level = level;
+  head->seed = xint(seed);
+  iappend(rootino, head, BSIZE - XV6_HDIR_SLOT * sizeof(struct dirent));
+
+  for(b = 0; b < nbucket; b++){
+    bzero(blk, sizeof(blk));
+    k = 0;
+    for(i = 0; i < nrootents; i++){
+      if(xv6_hdir_bucket(level, 0, xv6_hdir_hash(rootents[i].name, seed)) != b)
+        continue;
+      assert(k < nents);
+      blk[k++] = rootents[i];
+    }
+    iappend(rootino, blk, BSIZE);
+  }
+}
+
 static void
 die(const char *s)
 {
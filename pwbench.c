@@ -0,0 +1,125 @@
+/*
+ * Multi-thread pwrite scaling benchmark. Preallocates a file, then for
+ * 1, 2, 4, ... threads has each thread overwrite its own region of it,
+ * so no write extends the file. Run it on a mounted xv6fs:
+ *
+ *   pwbench /mnt/xv6/big [max threads] [file KiB] [write bytes]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PASSES 8  // times each thread rewrites its region
+
+static int fd;
+static size_t fsize, iosize;
+
+struct worker {
+  pthread_t tid;
+  off_t start, end;
+  int error;
+};
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *
+work(void *arg)
+{
+  struct worker *w = arg;
+  char *buf = malloc(iosize);
+  off_t off;
+  int pass;
+
+  memset(buf, 'a' + (int)(w->start % 26), iosize);
+  for(pass = 0; pass < PASSES && !w->error; pass++){
+    for(off = w->start; off + (off_t)iosize <= w->end; off += iosize){
+      if(pwrite(fd, buf, iosize, off) != (ssize_t)iosize){
+        w->error = errno ? errno : EIO;
+        break;
+      }
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxthreads, n, i;
+  char *buf;
+  size_t done;
+  double t, base = 0;
+
+  if(argc < 2){
+    fprintf(stderr, "Usage: pwbench file [max threads] [file KiB] [write bytes]\n");
+    exit(1);
+  }
+  maxthreads = argc > 2 ? atoi(argv[2]) : 8;
+  fsize = (argc > 3 ? strtoul(argv[3], 0, 0) : 256) * 1024;
+  iosize = argc > 4 ? strtoul(argv[4], 0, 0) : 4096;
+  if(maxthreads < 1 || iosize == 0 || fsize < iosize * maxthreads){
+    fprintf(stderr, "pwbench: the file must hold one write per thread\n");
+    exit(1);
+  }
+
+  if((fd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0){
+    perror(argv[1]);
+    exit(1);
+  }
+  // Preallocate, so that the timed writes stay inside i_size.
+  buf = calloc(1, iosize);
+  for(done = 0; done < fsize; done += iosize){
+    if(pwrite(fd, buf, iosize, done) != (ssize_t)iosize){
+      perror("pwrite");
+      exit(1);
+    }
+  }
+  free(buf);
+  if(fsync(fd) < 0){
+    perror("fsync");
+    exit(1);
+  }
+
+  printf("%zu KiB file, %zu-byte writes, %d passes\n",
+         fsize / 1024, iosize, PASSES);
+  printf("threads      MiB/s   speedup\n");
+  for(n = 1; n <= maxthreads; n *= 2){
+    struct worker *w = calloc(n, sizeof(*w));
+    // Regions are whole writes, so threads never share a block.
+    size_t per = fsize / n / iosize * iosize;
+    t = now();
+    for(i = 0; i < n; i++){
+      w[i].start = (off_t)per * i;
+      w[i].end = w[i].start + per;
+      pthread_create(&w[i].tid, NULL, work, &w[i]);
+    }
+    for(i = 0; i < n; i++)
+      pthread_join(w[i].tid, NULL);
+    t = now() - t;
+    for(i = 0; i < n; i++){
+      if(w[i].error){
+        fprintf(stderr, "pwbench: %s\n", strerror(w[i].error));
+        exit(1);
+      }
+    }
+    double mibs = (double)per * n * PASSES / (1 << 20) / t;
+    if(n == 1)
+      base = mibs;
+    printf("%7d %10.1f %8.2fx\n", n, mibs, mibs / base);
+    free(w);
+  }
+  close(fd);
+  return 0;
+}
@@ -13,6 +13,8 @@ static const struct checker modcheck = {
     .brelse = checker_brelse,
     .bdata = checker_data,
     .balloc = xv6_balloc,
+    .balloc_data = xv6_balloc_data,
+    .bfree = checker_bfree,
     .bflush = checker_bflush,
     .warning = checker_printk,
     .error = checker_printk,
@@ -47,6 +49,8 @@ static int xv6_fill_super(struct super_block *sb, struct fs_context *fc) {
     sb_set_blocksize(sb, BSIZE);
 	sb->s_fs_info = fsinfo;
 	sb->s_flags |= SB_NODIRATIME;
+    /* No xattrs; lets IS_NOSEC tell that a write need not drop privs. */
+    sb->s_flags |= SB_NOSEC;
 	sb->s_magic = FSMAGIC;
     sb->s_op = &xv6_super_ops;
 	sb->s_export_op = NULL /* FIXME */;
@@ -70,7 +74,13 @@ static int xv6_fill_super(struct super_block *sb, struct fs_context *fc) {
     fsinfo->logstart = __le32_to_cpu(xv6_sb->logstart);
     fsinfo->inodestart = __le32_to_cpu(xv6_sb->inodestart);
     fsinfo->bmapstart = __le32_to_cpu(xv6_sb->bmapstart);
+    fsinfo->features = __le32_to_cpu(xv6_sb->features);
     brelse(bh); bh = NULL;
+    if (fsinfo->features & ~(XV6_FEATURE_HDIR | XV6_FEATURE_ZFILE)) {
+        xv6_error("unsupported features 0x%x", fsinfo->features);
+        error = -EINVAL;
+        goto out_fail;
+    }
     mutex_init(&fsinfo->itree_lock);
     mutex_init(&fsinfo->balloc_lock);
     mutex_init(&fsinfo->build_inode_lock);
@@ -108,7 +118,7 @@ static int xv6_fill_super(struct super_block *sb, struct fs_context *fc) {
         }
 
     } while (0);
-
+    xv6_itypes_load(sb);
 
     /* Read root directory. */
     root_dir = xv6_find_inode(sb, ROOTINO, NULL);
@@ -146,6 +156,7 @@ static int xv6_fill_super(struct super_block *sb, struct fs_context *fc) {
         from_kgid_munged(&init_user_ns, fsinfo->options.gid));
     return 0;
 out_fail:
+    kvfree(fsinfo->itypes);
     kfree(fsinfo);
     if (bh) {
         brelse(bh);
@@ -156,6 +167,36 @@ out_fail:
     return error;
 }
 
+static void xv6_itypes_load(struct super_block *sb) {
+    struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    uchar *itypes = kvzalloc(fsinfo->ninodes, GFP_KERNEL);
+    if (!itypes) {
+        xv6_warn("no memory for inode types, readdir gives DT_UNKNOWN");
+        return;
+    }
+
+    for (uint inum = 0; inum < fsinfo->ninodes; inum += IPB) {
+        struct buffer_head *bh = sb_bread(sb, fsinfo->inodestart + inum / IPB);
+        if (!bh) {
+            kvfree(itypes);
+            return;
+        }
+        const struct dinode *dptr = (const struct dinode *) bh->b_data;
+        for (uint i = 0; i < IPB && inum + i < fsinfo->ninodes; i++) {
+            itypes[inum + i] = (uchar) __le16_to_cpu(dptr[i].type);
+        }
+        brelse(bh);
+    }
+    fsinfo->itypes = itypes;
+}
+
+static void xv6_itypes_set(struct super_block *sb, uint inum, ushort type) {
+    struct xv6_fs_info *fsinfo = sb->s_fs_info;
+    if (fsinfo->itypes && inum < fsinfo->ninodes) {
+        WRITE_ONCE(fsinfo->itypes[inum], (uchar) type);
+    }
+}
+
 static int xv6_get_tree(struct fs_context *fc) {
     return get_tree_bdev(fc, xv6_fill_super);
 }
@@ -204,6 +245,13 @@ static int xv6_show_options(struct seq_file *m, struct dentry *root) {
     return 0;
 }
   
+static void xv6_fs_corrupted(struct super_block *sb, const char *why) {
+    if (!(sb->s_flags & SB_RDONLY)) {
+        xv6_error("%s: %s; remounting read-only", sb->s_id, why);
+        sb->s_flags |= SB_RDONLY;
+    }
+}
+
 static void xv6_free_fc(struct fs_context *fc) {
     if (fc->fs_private) {
         kfree(fc->fs_private);
@@ -214,7 +262,7 @@ static void xv6_kill_block_super(struct super_block *sb) {
     /* 😭 Should not dput sb->s_root here. */
     /* Read the implementation of kill_block_super :) */
     xv6_info ("Unmounting xv6fs");
-    
+    struct xv6_fs_info *fsinfo = sb->s_fs_info;
 
     struct inode *inode;
     list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
@@ -222,6 +270,10 @@ static void xv6_kill_block_super(struct super_block *sb) {
         write_inode_now(inode, 1);
     }
     kill_block_super(sb);
+    if (fsinfo) {
+        kvfree(fsinfo->itypes);
+        fsinfo->itypes = NULL;
+    }
 }
 
 static inline int xv6_rb_cmp(const void *key, const struct rb_node *node) {
@@ -328,6 +380,7 @@ static const struct super_operations xv6_super_ops = {
     .destroy_inode = NULL,
     .show_options = xv6_show_options,
     .write_inode = xv6_write_inode,
+    .sync_fs = xv6_sync_fs,
     .evict_inode = xv6_evict_inode,
     .put_super = NULL,
 };
@@ -59,6 +59,19 @@ static inline void xv6_iunlock_exclusive(struct inode *ino) {
  * @returns -ERR if error occurred.
  */
 static int xv6_balloc(void *sb, uint *block);
+/*
+ * xv6_balloc, minus the zeroing: for file data, which get_block hands
+ * out as buffer_new so the page cache covers what is not written.
+ */
+static int xv6_balloc_data(void *sb, uint *block);
+/*
+ * Bitmap blocks are written back lazily. This writes the dirty ones,
+ * and runs before anything that can point at a new block (an inode,
+ * an indirect or a directory block) is written. Frees only reach the
+ * bitmap after the inode that dropped the block, so a crash never
+ * leaves a block in use but free on disk.
+ */
+static int xv6_bmap_sync(struct super_block *sb);
 /* call xv6_balloc, and initialize the block to zero. */
 static inline int xv6_balloc_zero(struct super_block *sb, uint *block) {
     return xv6_balloc(sb, block);
@@ -68,6 +81,21 @@ static inline int xv6_balloc_zero(struct super_block *sb, uint *block) {
  * @returns -ERR if error occurred.
  */
 static int xv6_bfree(struct super_block *sb, uint block);
+/*
+ * A block the on-disk inode may still point at cannot be freed yet: a
+ * crash would leave it free and in use. Such frees wait in ii->bpend
+ * until xv6_sync_inode has written the inode without them.
+ * xv6_bfree_reserve makes room for n more, so that xv6_bfree_later
+ * cannot fail; call it before taking any block out of the inode.
+ */
+static int xv6_bfree_reserve(struct inode *inode, uint n);
+static void xv6_bfree_later(struct inode *inode, uint block);
+/* Number of frees waiting now, to pass to xv6_bfree_release. */
+static uint xv6_bfree_waiting(struct inode *inode);
+/* The inode is on disk: free the first n waiting blocks. */
+static void xv6_bfree_release(struct inode *inode, uint n);
+/* Drop waiting frees without doing them, leaking the blocks. */
+static void xv6_bfree_forget(struct inode *inode);
 
 /* +-+ inode.c: inode operations. +-+ */
 static const struct dentry_operations xv6_dentry_ops;
@@ -101,8 +129,8 @@ static struct dentry *xv6_lookup(struct inode *dir, struct dentry *dentry,
  */
 static int xv6_hash(const struct dentry *dentry, struct qstr *qstr);
 /*
- * Compare two xv6 names. If either of the names are invalid,
- * we fall back to doing the standard name comparison.
+ * Compare two xv6 names. Like the on-disk lookup, only the first
+ * DIRSIZ bytes are significant, so it agrees with xv6_hash.
  */
 static int xv6_cmp(const struct dentry *dentry,
          unsigned int len, const char *str, const struct qstr *name);
@@ -114,10 +142,16 @@ static struct inode *xv6_iget(struct super_block *sb, uint inum);
 /* Returns 0 if ok; -ERR otherwise. */
 static int xv6_init_inode(struct inode *ino, const struct dinode *dino, uint inum);
 /* 
- * Sync size, nlink and address of inode to disk inode. 
+ * Sync size, nlink and address of inode to disk inode, then free the
+ * blocks it dropped before (see xv6_bfree_later).
  * This does not hold lock.
  */
 static int xv6_sync_inode(struct inode *ino);
+/* xv6_sync_inode with addresses `addrs', for an inode without i_private. */
+static int xv6_sync_dinode(struct inode *ino, const uint *addrs);
+static int xv6_sync_fs(struct super_block *sb, int wait) {
+    return xv6_bmap_sync(sb);
+}
 static int xv6_write_inode(struct inode *ino, struct writeback_control *wbc) {
     /* 
      * Assuming that only one copy of inode is present in cache, 
@@ -129,24 +163,23 @@ static int xv6_write_inode(struct inode *ino, struct writeback_control *wbc) {
     return ret; 
 }
 static void xv6_evict_inode(struct inode *ino);
+struct dentry *xv6_mkdir (struct mnt_idmap *mmap, struct inode *dir, 
+            struct dentry *dentry, umode_t mode);
 /*
- * Use the cached addresses in ino->i_private to accelerate `xv6_file_block`.
- * When the block is not present, set bhptr to null and return 0.
+ * Report the block map of an inode as extents, merging runs of blocks
+ * that are contiguous on disk (filefrag, FS_IOC_FIEMAP).
  */
-static int xv6_inode_block(struct inode *ino, uint i,
-            struct buffer_head **bhptr);
+static int xv6_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+            u64 start, u64 len);
+/* Write the inode without any block, then free them all. */
+static int xv6_inode_clear(struct inode *inode);
 /*
- * Get a block for writing. If a block does not exist, will try to allocate one.
- * If disk full, it returns -ENOSPC, and *bhptr is undefined.
- *
- * If inode is modified, it will properly mark it as dirty.
+ * Free the data blocks from logical block `first' on, and the indirect
+ * block if it is no longer needed. Leaves i_size alone. The bits are
+ * cleared once the inode is written, see xv6_bfree_later.
+ * Requires inode->i_private and the inode locked exclusively.
  */
-static int xv6_inode_wblock(struct inode *ino, uint i,
-            struct buffer_head **bhptr);
-struct dentry *xv6_mkdir (struct mnt_idmap *mmap, struct inode *dir, 
-            struct dentry *dentry, umode_t mode);
-/* Free all data blocks and indirect block of file. */
-static int xv6_inode_clear(struct inode *inode);
+static int xv6_inode_free_from(struct inode *inode, uint first);
 struct xv6_inode_ctx;
 static inline int xv6_ictx_dirty(struct inode *inode, 
                 struct xv6_inode_ctx *ictx);
@@ -175,8 +208,23 @@ static int xv6_dir_init(struct super_block *sb, uint block,
             uint inum_parent, uint inum_this);
 /*
  * First holds lock, and list the directory.
+ * Also reads ahead the inode blocks of listed entries.
  */
 static int xv6_readdir(struct file *dir, struct dir_context *ctx);
+/*
+ * Read ahead the directory from its logical block `i' through the
+ * block device's page cache. Like ext4_readdir, the window lives in
+ * file->f_ra, so it grows while readdir stays sequential.
+ */
+static void xv6_dir_ra(struct file *file, struct xv6_inode_ctx *ictx, uint i);
+/*
+ * Called by lookup with the position of the entry found. If lookups
+ * walk the directory in order (ls -l, rsync), read ahead the inode
+ * blocks of the entries that follow, and let readdir read ahead the
+ * inodes it emits. Skipped slots do not break the pattern as long as
+ * the next lookup lands in the same or the next directory block.
+ */
+static void xv6_dir_lookup_ra(struct inode *dir, uint dnum);
 
 static int xv6_unlink(struct inode *dir, struct dentry *entry);
 /* 
@@ -184,8 +232,66 @@ static int xv6_unlink(struct inode *dir, struct dentry *entry);
  * because of existence of hard link.
  */
 static int xv6_dir_erase(struct inode *dir, const char *name);
+/*
+ * Rename `oldname' to `newname' within one directory by rewriting the
+ * name of its dirent in place: one scan, one block write.
+ * @return 1 if dir is hashed, and the caller must erase and insert.
+ * @throw EEXIST if `newname' exists.
+ */
+static int xv6_dir_rename_local(struct inode *dir, const char *oldname,
+            const char *newname);
 
 static int xv6_rmdir(struct inode *dir, struct dentry *entry);
+/*
+ * Large directories keep an in-memory name index (struct xv6_dindex),
+ * built on first lookup and kept current by insert and erase.
+ * Detach and free it; used by evict.
+ */
+struct xv6_inode_info;
+static void xv6_dindex_drop(struct xv6_inode_info *ii);
+/*
+ * Pack the live entries of a linear directory to its front, shrink it
+ * and free its trailing blocks. Must hold dir exclusively. Entries keep
+ * their order and each copy is on disk before its original is cleared.
+ * @param self the handle asking for it, or NULL. Its position is moved
+ *             to the same entry in the packed directory.
+ * @throw EBUSY if the directory is open elsewhere, since entries move.
+ */
+static int xv6_dir_compact(struct inode *dir, struct file *self);
+/*
+ * Clear the originals of the `moved' slots of sbh once dbh is synced.
+ * If dbh cannot be written, its `copied' slots are cleared instead.
+ * @return true if sbh now has cleared originals to write.
+ */
+static bool xv6_dir_unlink_moved(struct super_block *sb,
+            struct buffer_head *dbh, struct buffer_head *sbh,
+            u64 *copied, u64 *moved, int *error);
+/*
+ * Write and release the source block of a compaction. Failing after
+ * originals were cleared (see xv6_dir_unlink_moved) is corruption.
+ */
+static void xv6_dir_putsrc(struct super_block *sb, struct buffer_head **sbhp,
+            bool *cleared, int *error);
+/* Is the directory sparse enough for erase to compact it? */
+static bool xv6_dir_sparse(struct inode *dir);
+static long xv6_dir_ioctl(struct file *file, unsigned int cmd,
+            unsigned long arg);
+/*
+ * Count open handles of a directory, see xv6_dir_compact. A compaction
+ * that erase had to leave runs at the next insert instead, so that a
+ * close never writes.
+ */
+static int xv6_dir_open(struct inode *inode, struct file *file);
+static int xv6_dir_release(struct inode *inode, struct file *file);
+/* Forget every known free dirent slot of a directory. */
+static void xv6_dfree_reset(struct xv6_inode_info *ii);
+/* Drop dfree.complete after a failed insert, see xv6_dfree_pick. */
+static void xv6_dfree_set_incomplete(struct inode *dir);
+/* Shrinker callbacks that free indexes under memory pressure. */
+static unsigned long xv6_dindex_count(struct shrinker *shrink,
+            struct shrink_control *sc);
+static unsigned long xv6_dindex_scan(struct shrinker *shrink,
+            struct shrink_control *sc);
 /* 
  * +-+ file.c: file read/write operations. 
  * (directory is organized much like a file) 
@@ -203,20 +309,121 @@ __attribute__((unused))
 static int xv6_file_block(struct super_block *sb, const struct dinode *file,
             uint i, struct buffer_head **bhptr);
 #define xv6_lseek  generic_file_llseek
-#define xv6_file_read_iter generic_file_read_iter
+/* 
+ * generic_file_read_iter, except that a NOWAIT direct read gets EAGAIN:
+ * blockdev_direct_IO always waits for its bios. A direct read of a file
+ * compressed since it was opened is buffered instead.
+ */
+static ssize_t xv6_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+/*
+ * Like generic_file_write_iter. An IOCB_NOWAIT write gets EAGAIN, since
+ * generic_perform_write can always sleep; the file ops leave out
+ * FOP_BUFFER_WASYNC, so io_uring punts buffered writes to a worker.
+ * Writes inside i_size hold i_rwsem shared plus a byte-range lock, so
+ * writers to disjoint ranges run in parallel; the others hold it
+ * exclusively.
+ */
+static ssize_t xv6_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
+/*
+ * Byte-range locks of xv6_inode_info::ranges. They only order writers
+ * that hold i_rwsem shared.
+ */
+struct xv6_inode_info;
+struct xv6_range;
+static bool xv6_range_trylock(struct xv6_inode_info *ii, struct xv6_range *r);
+static void xv6_range_lock(struct xv6_inode_info *ii, struct xv6_range *r);
+static void xv6_range_unlock(struct xv6_inode_info *ii, struct xv6_range *r);
 static int xv6_update_time(struct inode *a1, int a2) {
     return 0;
 }
-static ssize_t xv6_file_read(struct file *file, char __user *buf,
-            size_t len, loff_t *ppos);
-static ssize_t xv6_file_write(struct file *file, const char __user *buf,
-            size_t len, loff_t *ppos);
-static int xv6_file_sync(struct file *file, loff_t start, loff_t end, int arg4) {
-    return xv6_write_inode(file->f_inode, NULL);
-}
-static int xv6_file_flush(struct file *file, fl_owner_t id) {
-    return xv6_write_inode(file->f_inode, NULL);
-}
+/*
+ * Regular files go through the page cache. Maps logical block `iblock'
+ * of inode to its disk block, allocating it if `create'; leaves
+ * bh_result unmapped for a hole. Maps up to b_size bytes at once and
+ * trims b_size to the contiguous run (or hole) found there. With
+ * `create', a hole is allocated as one run for as long as the blocks
+ * balloc hands out stay contiguous, so a DIO append maps its whole
+ * extent in one call.
+ */
+static int xv6_get_block(struct inode *inode, sector_t iblock,
+            struct buffer_head *bh_result, int create);
+static const struct address_space_operations xv6_aops;
+/* Free the blocks a failed write allocated past i_size. */
+static void xv6_write_failed(struct address_space *mapping, loff_t to);
+/* Aligned O_DIRECT reads and writes, straight from user pages. */
+static ssize_t xv6_direct_IO(struct kiocb *iocb, struct iov_iter *iter);
+/*
+ * Shared writable mappings allocate blocks on the first write fault,
+ * so that writeback never has to.
+ */
+static vm_fault_t xv6_page_mkwrite(struct vm_fault *vmf);
+static int xv6_file_mmap(struct file *file, struct vm_area_struct *vma);
+/* generic_file_llseek, plus SEEK_HOLE and SEEK_DATA from the block map. */
+static loff_t xv6_llseek(struct file *file, loff_t offset, int whence);
+/* Allows O_DIRECT on regular files. */
+static int xv6_file_open(struct inode *inode, struct file *file);
+/*
+ * Writes back the dirty pages in [start, end], then the inode if it is
+ * dirty; fdatasync skips the inode unless I_DIRTY_DATASYNC. Indirect
+ * blocks are always written when allocated. O_SYNC, O_DSYNC and the
+ * `sync' mount option reach here through generic_write_sync.
+ */
+static int xv6_file_sync(struct file *file, loff_t start, loff_t end, 
+            int datasync);
+/*
+ * Compressed files (XV6_FEATURE_ZFILE) have their own file and address
+ * space operations, which decompress whole clusters into the page
+ * cache, see struct xv6_zhdr. They are never written as such: opening
+ * one for writing expands it to a plain file first.
+ */
+static const struct file_operations xv6_zfile_ops;
+static const struct address_space_operations xv6_zaops;
+/* Expands the file first if it is opened for writing. */
+static int xv6_zfile_open(struct inode *inode, struct file *file);
+/* Fills dst with the BSIZE << zshift bytes of cluster c. */
+static int xv6_zread_cluster(struct inode *inode, uint c, char *dst);
+/*
+ * Copies the bytes of folio out of the clusters it overlaps, expanding
+ * each into zb unless zb holds it already. A cluster may span several
+ * folios, so readahead passes the same zb for all of its folios.
+ */
+static int xv6_zfill_folio(struct inode *inode, struct folio *folio,
+            struct xv6_zbuf *zb);
+static int xv6_zread_folio(struct file *file, struct folio *folio);
+static void xv6_zreadahead(struct readahead_control *rac);
+/*
+ * Writes one block of data to a new block and records it as logical
+ * block lblk of the map in addrs, whose indirect block *ibh is
+ * allocated on first use. Nothing points at the map yet.
+ */
+static int xv6_zput(struct super_block *sb, uint *addrs,
+            struct buffer_head **ibh, uint lblk, const char *data);
+/* Frees the blocks of a map built by xv6_zput, and releases ibh. */
+static void xv6_zfree_map(struct super_block *sb, const uint *addrs,
+            struct buffer_head *ibh);
+/*
+ * Points inode at the map built by xv6_zput, stored as zalg with
+ * clusters of 1 << zshift blocks. The new blocks were written before,
+ * and addrs, major and minor go out in one inode write, so a crash
+ * leaves either file. The old blocks are freed after that write. The
+ * map is consumed even on failure. Caller holds the inode lock.
+ */
+static int xv6_zswap_map(struct inode *inode, uint *addrs,
+            struct buffer_head *ibh, uchar zalg, uchar zshift);
+/*
+ * Rewrites a compressed file as a plain one, leaving all-zero blocks as
+ * holes. It needs room for the expanded copy. Caller holds the lock.
+ */
+static int xv6_zfile_expand(struct inode *inode);
+/*
+ * Rewrites a plain file compressed with clusters of 1 << shift blocks,
+ * like mkxv6 -z, reading it through the page cache. Needs room for the
+ * compressed copy. Caller holds the inode lock and keeps writers out.
+ */
+static int xv6_zfile_compress(struct inode *inode, uint shift);
+/* XV6_IOC_ZCOMPRESS on a regular file. */
+static long xv6_file_ioctl(struct file *file, unsigned int cmd,
+            unsigned long arg);
 static int xv6_unlink(struct inode *dir, struct dentry *entry);
 static int xv6_link(struct dentry *oldentry, struct inode *dir, 
             struct dentry *entry);
@@ -251,6 +458,13 @@ static void xv6_free_inode(struct inode *inode);
  * @return NULL to indicate -ENOMEM.
  */
 static struct inode *xv6_find_inode(struct super_block *sb, uint inum, bool *found);
+/**
+ * Build fsinfo->itypes from the inode table, so that readdir can tell
+ * d_type without reading inodes. It is left NULL on failure.
+ */
+static void xv6_itypes_load(struct super_block *sb);
+/* Record the new type of inode `inum'; 0 for a freed one. */
+static void xv6_itypes_set(struct super_block *sb, uint inum, ushort type);
 
 static int xv6_parse_param(struct fs_context *fc, struct fs_parameter *param);
 static int xv6_show_options(struct seq_file *m, struct dentry *root);
@@ -261,6 +475,11 @@ static int xv6_reconfigure(struct fs_context *fc);
 static void xv6_free_fc(struct fs_context *fc);
 static const struct super_operations xv6_super_ops;
 static void xv6_kill_block_super(struct super_block *sb);
+/*
+ * The disk no longer matches what the file system expects: log why and
+ * stop writing to it, as ext4 does with errors=remount-ro.
+ */
+static void xv6_fs_corrupted(struct super_block *sb, const char *why);
 
 /* +-+ init.c +-+ */
 static const struct checker modcheck;
@@ -274,10 +493,13 @@ static void *checker_bread(void *privat, uint block);
 /* For checker::bdata */
 static void *checker_data(void *buffer);
 
-/* For checker::bfree */
+/* For checker::brelse */
 static void checker_brelse(void *buffer);
 
 /* Flush dirty block. */
 static int checker_bflush(void *privat, void *buf);
 
+/* For checker::bfree */
+static int checker_bfree(void *privat, uint block);
+
 #endif /* _XV6_H 1 */
@@ -0,0 +1,277 @@
+/*
+ * Host microbenchmarks of the directory code in fs.cpp, run over a
+ * directory built in memory. Usage: bench [entries]
+ */
+#include "xv6c++.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned char disk[(MAXFILE + 64) * BSIZE];
+static uint nextfree = 1;
+
+static void *bench_bread(void *, uint block) {
+    return disk + (size_t) block * BSIZE;
+}
+
+static void *bench_bdata(void *buf) {
+    return buf;
+}
+
+static void bench_brelse(void *) {}
+
+static int bench_balloc(void *, uint *block) {
+    *block = nextfree++;
+    memset(disk + (size_t) *block * BSIZE, 0, BSIZE);
+    return 0;
+}
+
+static int bench_bflush(void *, void *) {
+    return 0;
+}
+
+static void bench_message(const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+}
+
+__attribute__((noreturn))
+static void panic(const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+    abort();
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Keeps the compiler from dropping a result. */
+static volatile unsigned long sink;
+
+/* Names of every length from 1 to DIRSIZ. */
+static void bench_name(char *name, uint i) {
+    memset(name, 0, DIRSIZ);
+    snprintf(name, DIRSIZ, "f%u", i);
+    const uint len = 1 + i % DIRSIZ;
+    for (uint k = strlen(name); k < len; k++) {
+        name[k] = 'a' + (i + k) % 26;
+    }
+}
+
+/* The d_hash and d_compare of before: byte by byte over DIRSIZ bytes. */
+static uint bytewise_hash(const char *name) {
+    unsigned long h = 0;
+    for (int i = 0; i < DIRSIZ; i++) {
+        uchar c = name[i];
+        h = (h + (c << 4) + (c >> 4)) * 11;
+    }
+    return (uint) h;
+}
+
+static int bytewise_cmp(const char *pa, const char *pb) {
+    for (int i = 0; i < DIRSIZ; i++) {
+        uchar a = pa[i], b = pb[i];
+        if (a != b || !a) {
+            return (int) a - b;
+        }
+    }
+    return 0;
+}
+
+/*
+ * What a dcache hit costs: d_hash of the name looked up, then d_compare
+ * against the (equal) name of the dentry found in that hash chain.
+ */
+static void bench_hash(uint n) {
+    char (*names)[DIRSIZ] = (char (*)[DIRSIZ]) malloc(n * DIRSIZ);
+    char (*copies)[DIRSIZ] = (char (*)[DIRSIZ]) malloc(n * DIRSIZ);
+    uint *lens = (uint *) malloc(n * sizeof(uint));
+    for (uint i = 0; i < n; i++) {
+        bench_name(names[i], i);
+        memcpy(copies[i], names[i], DIRSIZ);
+        lens[i] = strnlen(names[i], DIRSIZ);
+    }
+    const uint rounds = 20000000 / n + 1;
+    unsigned long acc = 0;
+
+    double t = now();
+    for (uint r = 0; r < rounds; r++) {
+        for (uint i = 0; i < n; i++) {
+            acc += bytewise_hash(names[i]);
+            acc += bytewise_cmp(names[i], copies[i]);
+        }
+    }
+    const double old_ns = (now() - t) * 1e9 / ((double) rounds * n);
+
+    t = now();
+    for (uint r = 0; r < rounds; r++) {
+        for (uint i = 0; i < n; i++) {
+            struct xv6_dname a, b;
+            xv6_dname_from_str(&a, names[i], lens[i]);
+            acc += xv6_dname_hash(&a, 0);
+            /* xv6_cmp: the length check passes for a hit. */
+            xv6_dname_from_str(&a, names[i], lens[i]);
+            xv6_dname_from_str(&b, copies[i], lens[i]);
+            acc += xv6_dname_eq(&a, &b);
+        }
+    }
+    const double new_ns = (now() - t) * 1e9 / ((double) rounds * n);
+    sink = acc;
+    printf("hash+compare   bytewise %6.2f ns   xv6_dname    %6.2f ns   "
+                "(per dcache hit)\n", old_ns, new_ns);
+    free(names);
+    free(copies);
+    free(lens);
+}
+
+/* Lays out a linear directory of n named entries after . and .. */
+static void bench_mkdir(struct checker *check, struct xv6_inode_ctx *dir,
+            uint n) {
+    const uint nents = BSIZE / sizeof(struct dirent);
+    for (uint i = 0; i < n + 2; i++) {
+        uint blockno;
+        if (xv6_inode_addr(check, dir, i / nents, &blockno, true) != 0 ||
+                    blockno == 0) {
+            panic("bench: cannot allocate directory block %u\n", i / nents);
+        }
+        struct dirent *de = (struct dirent *) (disk + (size_t) blockno * BSIZE);
+        de += i % nents;
+        de->inum = 1 + i;
+        if (i >= 2) {
+            bench_name(de->name, i - 2);
+        } else {
+            strcpy(de->name, i ? ".." : ".");
+        }
+    }
+    dir->size = (n + 2) * sizeof(struct dirent);
+}
+
+/* The lookup of before: a C callback with strncmp on every entry. */
+static struct xv6_diter_action strncmp_find(uint dnum, struct dirent *de,
+            void *ctx) {
+    void **arr = (void **) ctx;
+    struct xv6_diter_action next = xv6_diter_action_init;
+    next.cont = 1;
+    if (de->inum && strncmp((const char *) arr[0], de->name, DIRSIZ) == 0) {
+        *(uint *) arr[1] = dnum;
+        next.cont = 0;
+    }
+    return next;
+}
+
+static void bench_lookup(struct checker *check, struct xv6_inode_ctx *dir,
+            uint n) {
+    const uint rounds = 2000000 / n + 1;
+    const uint nlookup = 64;
+    char name[DIRSIZ];
+    unsigned long acc = 0;
+
+    double t = now();
+    for (uint r = 0; r < rounds; r++) {
+        for (uint k = 0; k < nlookup; k++) {
+            uint dnum = 0;
+            bench_name(name, (k * 2654435761u + r) % n);
+            void *ctx[] = { name, &dnum };
+            xv6_dir_iterate(check, dir, strncmp_find, ctx, 2, false);
+            acc += dnum;
+        }
+    }
+    const double old_ns = (now() - t) * 1e9 / ((double) rounds * nlookup);
+
+    t = now();
+    for (uint r = 0; r < rounds; r++) {
+        for (uint k = 0; k < nlookup; k++) {
+            uint dnum = 0;
+            struct dirent de;
+            struct xv6_dname key;
+            bench_name(name, (k * 2654435761u + r) % n);
+            xv6_dname_from_str(&key, name, strnlen(name, DIRSIZ));
+            xv6_dir_find(check, dir, &key, 2, &dnum, &de);
+            acc += dnum;
+        }
+    }
+    const double new_ns = (now() - t) * 1e9 / ((double) rounds * nlookup);
+    sink = acc;
+    printf("lookup         strncmp  %6.0f ns   xv6_dir_find %6.0f ns   "
+                "(per lookup, %u entries)\n", old_ns, new_ns, n);
+}
+
+/* Counts live entries through the C ABI: a call and a ctx array each. */
+static struct xv6_diter_action count_live(uint dnum, struct dirent *de,
+            void *ctx) {
+    void **arr = (void **) ctx;
+    struct xv6_diter_action next = xv6_diter_action_init;
+    next.cont = 1;
+    *(uint *) arr[0] += de->inum != 0;
+    return next;
+}
+
+static void bench_iterate(struct checker *check, struct xv6_inode_ctx *dir,
+            uint n) {
+    const uint rounds = 20000000 / n + 1;
+    unsigned long acc = 0;
+
+    double t = now();
+    for (uint r = 0; r < rounds; r++) {
+        uint live = 0;
+        void *ctx[] = { &live };
+        xv6_dir_iterate(check, dir, count_live, ctx, 0, false);
+        acc += live;
+    }
+    const double old_ns = (now() - t) * 1e9 / ((double) rounds * (n + 2));
+
+    t = now();
+    for (uint r = 0; r < rounds; r++) {
+        uint live = 0;
+        xv6_dir_iterate_t(check, dir, [&live](uint, struct dirent *de) {
+            struct xv6_diter_action next = xv6_diter_action_init;
+            next.cont = 1;
+            live += de->inum != 0;
+            return next;
+        }, 0, false);
+        acc += live;
+    }
+    const double new_ns = (now() - t) * 1e9 / ((double) rounds * (n + 2));
+    sink = acc;
+    printf("iterate        callback %6.2f ns   template     %6.2f ns   "
+                "(per entry)\n", old_ns, new_ns);
+}
+
+int main(int argc, char **argv) {
+    const uint maxents = MAXFILE * (BSIZE / sizeof(struct dirent)) - 2;
+    uint n = argc > 1 ? strtoul(argv[1], nullptr, 0) : 4096;
+    if (n == 0 || n > maxents) {
+        fprintf(stderr, "usage: bench [entries], at most %u\n", maxents);
+        return 1;
+    }
+
+    struct checker check;
+    memset(&check, 0, sizeof(check));
+    check.err = check.warn = "";
+    check.warning = check.error = bench_message;
+    check.bread = bench_bread;
+    check.bdata = bench_bdata;
+    check.brelse = bench_brelse;
+    check.balloc = check.balloc_data = bench_balloc;
+    check.bflush = bench_bflush;
+    check.panic = panic;
+
+    uint addrs[NDIRECT + 1] = { 0 };
+    struct xv6_inode_ctx dir = { addrs, 0, false };
+    bench_mkdir(&check, &dir, n);
+
+    bench_hash(n);
+    bench_lookup(&check, &dir, n);
+    bench_iterate(&check, &dir, n);
+    return 0;
+}
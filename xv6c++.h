@@ -6,6 +6,7 @@ extern "C" {
 #endif /* C++ */
 
 #include "common.h"
+#include "fs.h"
 
 /* This inode context only keeps necessary info of an inode. */
 struct xv6_inode_ctx {
@@ -37,6 +38,18 @@ static inline uint _cpp_to_le32(uint a) {
 #define __cpu_to_le32(x) (_cpp_to_le32(x))
 #endif /* __cpu_to_le32 */
 
+#ifndef __cpu_to_le16
+static inline ushort _cpp_to_le16(ushort a) {
+    ushort ret = 0;
+    uchar *dst = (uchar *) &ret;
+    dst[0] = a & 0xff;
+    dst[1] = (a >> 8) & 0xff;
+    return ret;
+}
+
+#define __cpu_to_le16(x) (_cpp_to_le16(x))
+#endif /* __cpu_to_le16 */
+
 struct xv6_diter_action {
     unsigned char cont : 1, /* Should continue iteration */
         de_dirty: 1, /* dirent is dirty */
@@ -72,6 +85,190 @@ int xv6_dir_iterate(struct checker *check,
 int xv6_inode_addr(struct checker *check, struct xv6_inode_ctx *inode,
             uint i, uint *blockno, bool alloc);
 
+/* `len' logical blocks from `lblk', at disk blocks from `pblk'. */
+struct xv6_run {
+    uint lblk;  /* first logical block */
+    uint pblk;  /* first disk block; 0 for a hole */
+    uint len;   /* number of blocks */
+    bool fresh; /* allocated by this call */
+};
+
+/**
+ * Map blocks [first, first + count) of inode as runs of blocks that are
+ * contiguous on disk (or holes), reading the indirect block at most
+ * once. With `alloc', holes are allocated through checker::balloc_data,
+ * so fresh data blocks hold stale bytes until the caller writes them.
+ * @param[in,out] nrun the capacity of runs in; the runs filled out.
+ *   Mapping stops early when runs are full, see the last run's end.
+ *   A full array still grows its last run while the blocks allocated
+ *   for it stay contiguous, so nrun = 1 maps one whole extent.
+ */
+int xv6_inode_map(struct checker *check, struct xv6_inode_ctx *inode,
+            uint first, uint count, struct xv6_run *runs, uint *nrun,
+            bool alloc);
+
+/**
+ * Find the first block from the ith on that is mapped (`data') or a
+ * hole (!`data'), reading the indirect block at most once.
+ * @param[out] next the block found; MAXFILE if there is none.
+ */
+int xv6_inode_next(struct checker *check, struct xv6_inode_ctx *inode,
+            uint i, bool data, uint *next);
+
+/*
+ * Hashed directories (XV6_FEATURE_HDIR), see struct xv6_hdir in fs.h.
+ * As with xv6_dir_iterate, a dirty dir context must be synced by caller.
+ */
+
+/**
+ * Read the header of a hashed directory.
+ * @return 1 if dir is hashed, 0 if it is linear; -ERR on error.
+ */
+int xv6_hdir_head(struct checker *check, struct xv6_inode_ctx *dir,
+            struct xv6_hdir *head);
+
+/**
+ * Look up `name' in a hashed directory; reads block 0 and one bucket,
+ * or the whole directory on a miss once entries have spilled.
+ * @param[out] dnum the position of the entry, 0 if not found.
+ */
+int xv6_hdir_find(struct checker *check, struct xv6_inode_ctx *dir,
+            const char *name, uint *dnum, struct dirent *de);
+
+/**
+ * Insert `de' into a hashed directory. A full bucket costs at most one
+ * split, after which the entry spills to any free slot if need be.
+ * It will NOT check if the name already exists.
+ * @param move whether a split may move entries, i.e. no reader of the
+ *             directory holds a position in it.
+ * @throw ENOSPC if the directory is full and cannot grow any more.
+ */
+int xv6_hdir_insert(struct checker *check, struct xv6_inode_ctx *dir,
+            const struct dirent *de, uint *dnum, bool move);
+
+/**
+ * Turn a full, single-block linear directory into a hashed one, keyed
+ * with `seed' (see xv6_hdir_hash). This moves entries.
+ * @return 1 if converted, 0 if dir is left as it is; -ERR on error.
+ */
+int xv6_hdir_convert(struct checker *check, struct xv6_inode_ctx *dir,
+            uint seed);
+
+/*
+ * A directory entry name packed into two words, with every byte at and
+ * after the first NUL cleared. Names longer than DIRSIZ are truncated,
+ * which matches the strncmp(.., DIRSIZ) semantic of on-disk lookups.
+ * Two names are equal iff both words are equal.
+ */
+struct xv6_dname {
+    unsigned long long lo; /* name[0..7] */
+    unsigned long long hi; /* name[8..13], top two bytes are zero. */
+};
+
+#define XV6_DNAME_ONES  0x0101010101010101ULL
+#define XV6_DNAME_HIGHS 0x8080808080808080ULL
+#define XV6_DNAME_GOLDEN 0x9e3779b97f4a7c15ULL
+
+/* Clear the bytes at and after the first NUL, without branching. */
+static inline void xv6_dname_mask(struct xv6_dname *n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* The lowest set bit of `z' always marks the first zero byte. */
+    unsigned long long z = (n->lo - XV6_DNAME_ONES) & ~n->lo & XV6_DNAME_HIGHS;
+    n->lo &= ((z & -z) >> 7) - 1;
+    n->hi &= (unsigned long long) (z != 0) - 1;
+    z = (n->hi - XV6_DNAME_ONES) & ~n->hi & XV6_DNAME_HIGHS;
+    n->hi &= ((z & -z) >> 7) - 1;
+#else
+    uchar *p = (uchar *) n;
+    bool end = false;
+    for (uint i = 0; i < sizeof(*n); i++) {
+        end |= (p[i] == 0);
+        p[i] = end ? 0 : p[i];
+    }
+#endif
+}
+
+/* Pack the name of an on-disk dirent (with two 8-byte loads). */
+static inline void xv6_dname_from_dirent(struct xv6_dname *n,
+            const struct dirent *de) {
+    __builtin_memcpy(&n->lo, de->name, 8);
+    __builtin_memcpy(&n->hi, de->name + DIRSIZ - 8, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    n->hi >>= 8 * (16 - DIRSIZ);
+#else
+    n->hi <<= 8 * (16 - DIRSIZ);
+#endif
+    xv6_dname_mask(n);
+}
+
+/*
+ * Pack a name of `len' bytes, which need not be NUL-terminated. Reads
+ * only those bytes, with at most two overlapping fixed-size loads.
+ */
+static inline void xv6_dname_from_str(struct xv6_dname *n,
+            const char *s, uint len) {
+    len = xv6_min(len, (uint) DIRSIZ);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    unsigned long long lo = 0, hi = 0;
+    if (len >= 8) {
+        __builtin_memcpy(&lo, s, 8);
+        __builtin_memcpy(&hi, s + len - 8, 8);
+        hi = len > 8 ? hi >> 8 * (16 - len) : 0;
+    } else if (len >= 4) {
+        uint a, b;
+        __builtin_memcpy(&a, s, 4);
+        __builtin_memcpy(&b, s + len - 4, 4);
+        lo = a | (unsigned long long) b << 8 * (len - 4);
+    } else if (len > 0) {
+        lo = (uchar) s[0] | (uchar) s[len / 2] << 8 * (len / 2) |
+                    (unsigned long long) (uchar) s[len - 1] << 8 * (len - 1);
+    }
+    n->lo = lo;
+    n->hi = hi;
+#else
+    n->lo = n->hi = 0;
+    __builtin_memcpy(n, s, len);
+#endif
+    xv6_dname_mask(n);
+}
+
+static inline bool xv6_dname_eq(const struct xv6_dname *a,
+            const struct xv6_dname *b) {
+    return ((a->lo ^ b->lo) | (a->hi ^ b->hi)) == 0;
+}
+
+/* Hash a packed name; `salt' is mixed in like full_name_hash does. */
+static inline uint xv6_dname_hash(const struct xv6_dname *n,
+            unsigned long salt) {
+    unsigned long long h = (n->lo ^ salt) * XV6_DNAME_GOLDEN;
+    h = (h ^ (h >> 29) ^ n->hi) * XV6_DNAME_GOLDEN;
+    return (uint) (h >> 32);
+}
+
+/*
+ * Scan entries [from, to) of a directory block for `key', comparing a
+ * whole entry with a few word operations instead of a per-entry
+ * callback. Entries with a null inum never match.
+ * @return the slot found, or `to' if there is none.
+ */
+uint xv6_dblock_find(const struct dirent *des, uint from, uint to,
+            const struct xv6_dname *key);
+
+/**
+ * Find `key' in a linear directory from entry `off', block by block.
+ * @param[out] dnum the position of the entry, 0 if not found.
+ */
+int xv6_dir_find(struct checker *check, struct xv6_inode_ctx *dir,
+            const struct xv6_dname *key, uint off,
+            uint *dnum, struct dirent *de);
+
+/**
+ * Are entries from `off' on all free?
+ * @return 1 if so, 0 if not; -ERR on error.
+ */
+int xv6_dir_empty(struct checker *check, struct xv6_inode_ctx *dir,
+            uint off);
+
 #ifndef __le16_to_cpu
 static inline ushort _cpp_to_cpu16(ushort a) {
     ushort b = 0;
@@ -99,6 +296,104 @@ static inline uint _cpp_to_cpu32(uint a) {
 
 #ifdef __cplusplus
 }
+/* extern "C" */
+
+#include "check.h"
+
+/*
+ * xv6_dir_iterate with the callback as a type parameter, so that it
+ * can be inlined into the loop. `callback' is any callable taking
+ * (uint dnum, struct dirent *de) and returning xv6_diter_action.
+ * xv6_dir_iterate is a thin wrapper of it for the C side.
+ */
+template <typename _Fn>
+int xv6_dir_iterate_t(struct checker *check,
+            struct xv6_inode_ctx *dir, 
+            _Fn &&callback, /* iteration callback. */
+            uint off, /* offset in entries. */
+            bool rw) {
+    auto size = dir->size;
+    if (size % sizeof(struct dirent) != 0 || size < 2 * sizeof(struct dirent)) {
+        check->panic("xv6: dir has incorrect size");
+    }
+    const uint nents = BSIZE / sizeof(struct dirent);
+    size /= sizeof(struct dirent);
+
+    if (off > size) {
+        /* Reached the end. should check to avoid underflow */
+        return 0;
+    }
+    size -= off;
+
+    bool alloc = rw /* read-write enabled. */;
+    uint i = off / nents;
+    off = off % nents;
+    struct xv6_diter_action act = xv6_diter_action_init;
+    int error;
+    uint blockno;
+    while ((error = xv6_inode_addr(check, dir, i, &blockno, alloc)) == 0) {
+        const uint lim = xv6_min(nents, size + off);
+        if (blockno == 0) {
+            uchar dummy[sizeof(struct dirent)] = {0};
+            /* Most callback relies on it only called once. */
+            act = callback(i * nents, (struct dirent *) &dummy);
+            if (act.de_dirty) {
+                check->warning("%s dentry should not be dirty", check->warn);
+            }
+            if (!act.cont) {
+                break;
+            }
+        } else {
+            struct bufptr debuf (check->bread(check->privat, blockno), check);
+            if (debuf.buf_ == nullptr) {
+                error = -EIO;
+                break;
+            }
+            struct dirent *deptr = (struct dirent *) debuf.data();
+            bool flush = false;
+            for (uint k = off; k < lim; k++) {
+                act = callback(i * nents + k, &deptr[k]);
+                flush |= act.de_dirty;
+                if (!act.cont) {
+                    break;
+                }
+            }
+            if (flush) {
+                error = check->bflush(check->privat, debuf.buf_);
+            }
+        }
+
+        if (!act.cont || error) { break; }
+        i++;
+        size -= (lim - off);
+        off = 0;
+        if (!size) { break;}
+    }
+
+    if (!error && act.cont && act.dir_ext) {
+        /* operate on one more dentry. possibly used by insert. */
+        size = dir->size;
+        size /= sizeof(struct dirent);
+        error = xv6_inode_addr(check, dir, size / nents, &blockno, alloc);
+        if (error) { return error; }
+        struct bufptr debuf (check->bread(check->privat, blockno), check);
+        if (debuf.buf_ == nullptr) { return -EIO; }
+        struct dirent *deptr = (struct dirent *) debuf.data();
+        deptr += size % nents;
+        act = callback(size, deptr);
+        if (act.dir_dirty) {
+            /* The insert method wants to extend inode. */
+            dir->dirty = true;
+            dir->size += sizeof(struct dirent);
+        }
+        if (act.de_dirty) {
+            error = check->bflush(check->privat, debuf.buf_);
+        }
+    }
+
+    return error;
+}
+
 #endif /* C++ */
 
 #endif /* _XV6_CPP_H 1 */